@@ -1,11 +1,33 @@
 # Analyzes control and data flow in functions, in order to optimize
 
 # Note: we assume that:
-#   - only `stkcopy' and `call' affect the stack.
-#   - `glk' instructions break the analysis
+#   - only `call', `glk' and the `stk' instructions affect the stack, and
+#     the latter only when their operands are immediate.
+#   - `glk' only pops its arguments if its selector is one of
+#     stack_neutral_glk; other glk instructions break the analysis, since Glk
+#     functions that take references or arrays use the stack for them if they
+#     are passed -1 as an address
+#   - `catch' instructions break the analysis (their call stub is stored on
+#     the data stack)
 
 from sys import stderr
 
+# Selectors of Glk functions without reference or array arguments:
+stack_neutral_glk = set([
+    0x0001, 0x0003, 0x0004,                                 # exit .. gestalt
+    0x0021, 0x0022, 0x0023, 0x0026, 0x0028, 0x0029, 0x002A, # window_*
+    0x002B, 0x002C, 0x002D, 0x002E, 0x002F, 0x0030,
+    0x0041, 0x0042, 0x0045, 0x0046, 0x0047, 0x0048,         # stream_*
+    0x0060, 0x0061, 0x0062, 0x0063, 0x0065, 0x0066, 0x0067, # fileref_*
+    0x0068,
+    0x0080, 0x0081, 0x0082, 0x0083, 0x0086, 0x0087, 0x0090, # put/get_char
+    0x00A0, 0x00A1, 0x00B0, 0x00B1, 0x00B2,                 # styles
+    0x00D2, 0x00D3, 0x00D4, 0x00D5, 0x00D6,                 # events
+    0x00E1, 0x00E2, 0x00E8, 0x00E9, 0x00EA, 0x00EB,         # images
+    0x0100, 0x0101, 0x0102, 0x0103,                         # hyperlinks
+    0x0128, 0x0129, 0x012B, 0x012C, 0x0130, 0x0138, 0x0140  # unicode
+])
+
 # Returns a control flow graph for the given instruction list:
 def analyze_control_flow(instrs):
     edges = []
@@ -15,8 +37,13 @@ def analyze_control_flow(instrs):
         addrs[instr.offset()] = i
 
     for (i,instr) in enumerate(instrs):
-        if instr.mnemonic == 'glk':
-            # For now, don't optimize functions with glk instructions
+        if instr.mnemonic == 'catch':
+            print >>stderr, 'Skipping analysis due to catch instruction'
+            return None
+
+        if instr.mnemonic == 'glk' and not (
+                instr.operands[0].is_immediate() and
+                instr.operands[0].value() & 0xffffffff in stack_neutral_glk):
             print >>stderr, 'Skipping analysis due to glk instruction'
             return None
 
@@ -39,11 +66,6 @@ def analyze_control_flow(instrs):
                 return None
             edges.append((i, addrs[dest]))
 
-        if instrs[i].mnemonic.startswith('stk'):
-            print >>stderr, 'Skipping analysis due to occurrence of', \
-                    instrs[i].mnemonic, 'instruction'
-            return None
-
     return edges
 
 def analyze_stack_pointer(instrs, edges):
@@ -66,8 +88,8 @@ def analyze_stack_pointer(instrs, edges):
                 else:
                     assert p == 's'
 
-        # adjust stack location after (tail)call instruction
-        if instrs[i].mnemonic == 'call' or instrs[i].mnemonic == 'tailcall':
+        # adjust stack location after (tail)call or glk instruction
+        if instrs[i].mnemonic in ('call', 'tailcall', 'glk'):
             o = instrs[i].operands[1]
             if not o.is_immediate():
                 print >>stderr, 'Skipping analysis due to', \
@@ -76,6 +98,40 @@ def analyze_stack_pointer(instrs, edges):
             assert o.value() is not None
             h -= o.value()
 
+        # lowest stack location popped by the instruction:
+        instrs[i].sp_low = h
+
+        # model stack manipulation instructions; instr.stk_sp is the stack
+        # height after loading operands, and instr.stk_low the lowest stack
+        # location accessed (or just above the top, for stkcount):
+        if instrs[i].mnemonic.startswith('stk'):
+            instr = instrs[i]
+            loads = [ o for (o, p) in zip(instr.operands, instr.parameters)
+                      if p in "lmf" ]
+            if [ o for o in loads if not o.is_immediate() ]:
+                print >>stderr, 'Skipping analysis due to', instr.mnemonic, \
+                    'instruction with indeterminate operands'
+                return None
+            args = [ o.value() & 0xffffffff for o in loads ]
+            if args and args[0] > 0xffff:
+                print >>stderr, 'Skipping analysis due to', instr.mnemonic, \
+                    'instruction with invalid count'
+                return None
+            instr.stk_sp = h
+            if instr.mnemonic == 'stkcount':
+                instr.stk_low = h
+            elif instr.mnemonic == 'stkpeek':
+                instr.stk_low = h - 1 - args[0]
+            elif instr.mnemonic == 'stkswap':
+                instr.stk_low = h - 2
+            elif instr.mnemonic == 'stkcopy':
+                instr.stk_low = h - args[0]
+                h += args[0]
+            elif instr.mnemonic == 'stkroll':
+                instr.stk_low = h - args[0]
+            else:
+                assert 0
+
         # assign stack locations of stored stack operands:
         for o, p in zip(instrs[i].operands, instrs[i].parameters):
             if o.is_stack_ref():
@@ -113,4 +169,321 @@ def optimize(instrs):
     if height.count(None) == len(height):
         return []
     else:
-        return range(min(height), max(height))
+        low = [ instr.sp_low for instr in instrs ] + \
+              [ instr.stk_low for instr in instrs
+                if instr.mnemonic.startswith('stk') ]
+        return range(min(height + low), max(height))
+
+# Number of bytes accessed by operands of each size (see opcode-map.txt):
+size_bytes = { 'B': 1, 'b': 1, 'S': 2, 's': 2, 'L': 4, 'l': 4, 'f': 4 }
+
+def memory_key(o, size, ramstart):
+    '''Returns a pair (address, number of bytes) for memory operand `o' of the
+       given size, or None if `o' doesn't refer to RAM at a constant address.
+       (Constant loads from ROM are folded by the translator instead.)'''
+    if o.is_mem_ref():
+        addr = o.value() & 0xffffffff
+    elif o.is_ram_ref():
+        addr = (ramstart + o.value()) & 0xffffffff
+    else:
+        return None
+    n = size_bytes[size]
+    if addr + n <= ramstart:
+        return None
+    return (addr, n)
+
+def overlaps(a, b):
+    return a[0] < b[0] + b[1] and b[0] < a[0] + a[1]
+
+# Memory analysis: determines which memory operands at constant addresses
+# hold values that are already known, because they were loaded or stored
+# earlier, with no memory writes in between. The translator keeps these values
+# in C variables, so they need not be loaded again; the C compiler can't
+# do this itself, since every memory access is a (byte-swapped) load from or
+# store to the global mem[] array.
+#
+# Before calling analyze_memory(), each instruction must have the attributes:
+#   instr.mem_loads     list of keys (see memory_key()) of loaded operands
+#   instr.mem_stores    list of keys of stored operands
+#   instr.mem_clobbers  list of keys of memory that the instruction may write
+#                       otherwise (for example, a function call)
+#   instr.mem_writes    whether the instruction may write to any memory
+#                       (for example, through an unknown function call or Glk)
+#
+# Afterwards, instructions have the attributes:
+#   instr.mem_avail     set of keys whose values are known on entry
+#   instr.mem_preload   keys loaded before entering the loop that starts at
+#                       this instruction (see below), in address order
+#   instr.mem_preheader whether branches from this instruction must jump to
+#                       the loop preheader of their target
+#
+# Loop-invariant loads are hoisted: if a loop (found through a branch back to
+# an earlier instruction) loads a memory location that it never writes, the
+# location is loaded in a preheader right in front of the loop header. Entry
+# into the loop from outside goes through the preheader, while branches within
+# the loop jump to the header directly. Only locations below ENDMEM are
+# preloaded, since those always exist even if the loop doesn't execute.
+
+def memory_flow_graph(instrs):
+    '''Returns a list of (source, destination, fall-through) edges between the
+       instructions of a function, or None if the function cannot be analyzed.
+       Indirect branches and jumps out of the function leave it, just like
+       returns do.'''
+    addrs = {}
+    for (i,instr) in enumerate(instrs):
+        addrs[instr.offset()] = i
+
+    edges = []
+    for (i,instr) in enumerate(instrs):
+        if instr.mnemonic == 'catch':
+            return None  # throw may resume after any call
+
+        if instr.mnemonic not in ('tailcall', 'ret', 'throw', 'jump',
+                                  'jumpabs', 'quit', 'restart'):
+            if i + 1 >= len(instrs):
+                return None
+            edges.append((i, i + 1, True))
+
+        if instr.is_branch() and instr.return_value() is None:
+            dest = instr.branch_target()
+            if dest in addrs:
+                edges.append((i, addrs[dest], False))
+            elif dest is not None and instr.mnemonic != 'jumpabs':
+                return None
+
+    return edges
+
+def find_loops(instrs, edges, endmem):
+    '''Returns a dictionary mapping loop headers to a pair of the set of
+       instructions in the loop, and the keys that can be preloaded.'''
+    preds = [ [] for instr in instrs ]
+    for (i, j, fall) in edges:
+        preds[j].append(i)
+
+    bodies = {}
+    for (i, j, fall) in edges:
+        if j <= i:
+            body = bodies.setdefault(j, set([j]))
+            todo = [ i ]
+            while todo:
+                k = todo.pop()
+                if k not in body:
+                    body.add(k)
+                    todo += preds[k]
+
+    loops = {}
+    for (header, body) in bodies.items():
+        if [ k for k in body if instrs[k].mem_writes ]:
+            continue
+        stores = [ s for k in body
+                   for s in instrs[k].mem_stores + instrs[k].mem_clobbers ]
+        preload = set([ l for k in body for l in instrs[k].mem_loads
+                        if l[0] + l[1] <= endmem ])
+        preload = [ l for l in preload
+                    if not [ s for s in stores if overlaps(l, s) ] ]
+        if preload:
+            loops[header] = (body, sorted(preload))
+    return loops
+
+def memory_transfer(instr, avail):
+    '''Returns the set of known keys after `instr', given the set before.'''
+    avail = avail.union(instr.mem_loads)
+    if instr.mem_writes:
+        avail = frozenset()
+    for s in instr.mem_clobbers:
+        avail = frozenset([ k for k in avail if not overlaps(k, s) ])
+    for s in instr.mem_stores:
+        avail = frozenset([ k for k in avail if not overlaps(k, s) ] + [s])
+    return avail
+
+def analyze_memory(instrs, endmem):
+    for instr in instrs:
+        instr.mem_avail     = frozenset()
+        instr.mem_preload   = []
+        instr.mem_preheader = False
+
+    edges = memory_flow_graph(instrs)
+    if edges is None or not instrs:
+        return
+
+    loops = find_loops(instrs, edges, endmem)
+    for (header, (body, preload)) in loops.items():
+        instrs[header].mem_preload = preload
+        for (i, j, fall) in edges:
+            if j == header and not fall and i not in body:
+                instrs[i].mem_preheader = True
+
+    succs = [ [] for instr in instrs ]
+    for (i, j, fall) in edges:
+        # edges into a loop that pass through its preheader:
+        via_preheader = j in loops and (fall or instrs[i].mem_preheader)
+        succs[i].append((j, via_preheader))
+
+    # Forward data flow analysis: a key is known at an instruction if it is
+    # known on all incoming edges. Instructions that haven't been reached yet
+    # have unknown state (None).
+    avail = [ None ]*len(instrs)
+    avail[0] = frozenset(instrs[0].mem_preload)
+    todo = [ 0 ]
+    while todo:
+        i = todo.pop()
+        out = memory_transfer(instrs[i], avail[i])
+        for (j, via_preheader) in succs[i]:
+            new = out
+            if via_preheader:
+                new = new.union(instrs[j].mem_preload)
+            if avail[j] is not None:
+                new = new.intersection(avail[j])
+            if new != avail[j]:
+                avail[j] = new
+                todo.append(j)
+
+    for (instr, a) in zip(instrs, avail):
+        if a is not None:
+            instr.mem_avail = a
+
+# Loop idioms: counted loops that copy, fill, search or compare arrays one
+# element at a time, through a local variable used as the index, like this
+# byte copy:
+#
+#   a:  jge i n c           loop while i < n (also jgeu, or jle/jleu n i)
+#       aloadb src i sp
+#       astoreb dst i sp
+#       add i 1 i
+#       jump a
+#   c:
+#
+# The translator replaces the loop header with a call to a kernel that
+# processes the remaining elements at once (see native/native_loops.c), and
+# sets the index as the loop would have on exit; the loop body remains, but
+# is no longer reached. The other patterns are a fill (`astoreb dst i v'), a
+# search (`aloadb base i sp; jeq sp v found', or jne to skip equal elements)
+# and a comparison (`aloadb a i sp; aloadb b i sp; jne sp sp differ'), with
+# aloads/astores or aload/astore for arrays of 16- or 32-bit elements.
+#
+# Operands other than the index must be constants or other local variables,
+# which the loop doesn't change. Searches and comparisons don't write memory,
+# so they may also use memory operands.
+#
+# Afterwards, instructions have the attribute:
+#   instr.loop_idiom    None, or for a loop header a tuple (kind, size,
+#                       index, operands, exit), where kind is 'copy' (with
+#                       operands dst, src), 'fill' (dst, value), 'find' or
+#                       'skip' (base, value), or 'compare' (a, b); size is the
+#                       element size in bytes, index the number of the local
+#                       variable and exit the branch instruction in the body
+#                       that leaves the loop early (or None).
+
+element_sizes = { 'aloadb': 1, 'aloads': 2, 'aload': 4,
+                  'astoreb': 1, 'astores': 2, 'astore': 4 }
+
+def match_loop_idiom(instrs, k, entered):
+    '''Returns the loop idiom (see above) of the loop with its header at
+       index `k', or None if it doesn't match one. `entered' is the set of
+       offsets of instructions that are branch targets.'''
+    header = instrs[k]
+    if header.mnemonic in ('jge', 'jgeu'):
+        index, bound = header.operands[0], header.operands[1]
+    elif header.mnemonic in ('jle', 'jleu'):
+        bound, index = header.operands[0], header.operands[1]
+    else:
+        return None
+    if not index.is_local_ref() or bound.is_stack_ref():
+        return None
+
+    # Find the increment and the jump back to the header:
+    for m in range(k + 2, min(k + 6, len(instrs))):
+        if instrs[m].mnemonic == 'jump' and \
+                instrs[m].branch_target() == header.offset():
+            break
+    else:
+        return None
+    body = instrs[k + 1:m - 1]
+    if not body or not is_increment(instrs[m - 1], index):
+        return None
+
+    # The loop must only be entered through its header, and exits must leave
+    # it (branches in the body are checked below):
+    inside = set([ instr.offset() for instr in instrs[k:m + 1] ])
+    if inside & (entered - set([header.offset()])) or \
+            header.branch_target() in inside:
+        return None
+
+    def leaves(instr):
+        return instr.branch_target() not in inside and \
+            (instr.branch_target() is not None or
+             instr.return_value() is not None)
+
+    def invariant(o, read_only):
+        # Memory operands are only allowed if the loop doesn't write memory
+        if o.is_local_ref():
+            return not is_local(o, index)
+        if o.is_mem_ref() or o.is_ram_ref():
+            return read_only
+        return o.is_immediate()
+
+    def element(instr, read_only):
+        return instr.mnemonic in element_sizes and \
+            is_local(instr.operands[1], index) and \
+            invariant(instr.operands[0], read_only)
+
+    mnemonics = [ instr.mnemonic for instr in body ]
+    if len(body) == 1 and mnemonics[0].startswith('astore'):
+        store = body[0]
+        if element(store, False) and invariant(store.operands[2], False) and \
+                invariant(bound, False):
+            return ('fill', element_sizes[store.mnemonic], index.value()//4,
+                    [store.operands[0], store.operands[2]], None)
+
+    elif len(body) == 2 and mnemonics[0].startswith('aload') and \
+            mnemonics[1].startswith('astore'):
+        load, store = body
+        if element(load, False) and load.operands[2].is_stack_ref() and \
+                element(store, False) and store.operands[2].is_stack_ref() and \
+                element_sizes[load.mnemonic] == element_sizes[store.mnemonic] \
+                and invariant(bound, False):
+            return ('copy', element_sizes[load.mnemonic], index.value()//4,
+                    [store.operands[0], load.operands[0]], None)
+
+    elif len(body) == 2 and mnemonics[0].startswith('aload') and \
+            mnemonics[1] in ('jeq', 'jne'):
+        load, test = body
+        values = [ o for o in test.operands[:2] if not o.is_stack_ref() ]
+        if element(load, True) and load.operands[2].is_stack_ref() and \
+                len(values) == 1 and invariant(values[0], True) and \
+                invariant(bound, True) and leaves(test):
+            return ({ 'jeq': 'find', 'jne': 'skip' }[test.mnemonic],
+                    element_sizes[load.mnemonic], index.value()//4,
+                    [load.operands[0], values[0]], test)
+
+    elif len(body) == 3 and mnemonics[0] == mnemonics[1] and \
+            mnemonics[0].startswith('aload') and mnemonics[2] == 'jne':
+        a, b, test = body
+        if element(a, True) and a.operands[2].is_stack_ref() and \
+                element(b, True) and b.operands[2].is_stack_ref() and \
+                test.operands[0].is_stack_ref() and \
+                test.operands[1].is_stack_ref() and \
+                invariant(bound, True) and leaves(test):
+            return ('compare', element_sizes[a.mnemonic], index.value()//4,
+                    [a.operands[0], b.operands[0]], test)
+
+    return None
+
+def is_local(o, index):
+    return o.is_local_ref() and o.value() == index.value()
+
+def is_increment(instr, index):
+    '''Returns whether `instr' adds 1 to the local variable `index'.'''
+    if instr.mnemonic != 'add':
+        return False
+    a, b, dest = instr.operands
+    one = lambda o: o.is_immediate() and o.value() == 1
+    return is_local(dest, index) and \
+        (is_local(a, index) and one(b) or one(a) and is_local(b, index))
+
+def find_loop_idioms(instrs):
+    entered = set([ instr.branch_target() for instr in instrs ])
+    for instr in instrs:
+        instr.loop_idiom = None
+    for (k, instr) in enumerate(instrs):
+        instr.loop_idiom = match_loop_idiom(instrs, k, entered)
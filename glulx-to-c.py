@@ -1,13 +1,183 @@
 #!/usr/bin/env python
 
+import getopt
 import glulxd
+import re
+import struct
 import sys
 from Ops import *
-from analyze import optimize
+from glulx import unpack, unpacks
+from analyze import optimize, analyze_memory, memory_key, find_loop_idioms, \
+    stack_neutral_glk
+from inline import inline_functions
 
 # Maps mnemonics to 3-tuple of parameters, sizes and code.
 opcode_map = {}
 
+# Output instructions that use the data stack only to call the filter function
+# of the filter I/O system:
+filter_stream_ops = ('streamchar', 'streamunichar', 'streamnum')
+
+# Functions called by instruction templates that don't write to memory:
+memory_safe_calls = ('get_byte', 'get_shrt', 'get_long', 'native_gestalt',
+    'native_random', 'native_setrandom', 'native_getmemsize', 'native_verify',
+    'native_getiosys', 'native_setiosys', 'native_getstringtbl',
+    'native_setstringtbl', 'native_linearsearch', 'native_binarysearch',
+    'native_linkedsearch', 'native_ftonumz', 'native_ftonumn',
+    'native_stkroll', 'native_accelfunc', 'native_accelparam',
+    'native_protect', 'native_debugtrap', 'fabsf', 'truncf', 'floorf',
+    'ceilf', 'sqrtf', 'expf', 'logf', 'powf', 'fmodf', 'sinf', 'cosf', 'tanf',
+    'asinf', 'acosf', 'atanf', 'atan2f')
+
+# Functions called by instruction templates whose results depend only on
+# their arguments (see reads_only_rom(); native_gestalt() is pure only for
+# some selectors):
+pure_calls = ('native_ftonumz', 'native_ftonumn', 'native_stkroll', 'fabsf',
+    'truncf', 'floorf', 'ceilf', 'sqrtf', 'expf', 'logf', 'powf', 'fmodf',
+    'sinf', 'cosf', 'tanf', 'asinf', 'acosf', 'atanf', 'atan2f')
+
+# Instructions with effects outside of memory and the data stack:
+external_effect_ops = ('glk', 'streamchar', 'streamunichar', 'streamnum',
+    'streamstr', 'setiosys', 'setstringtbl', 'random', 'setrandom', 'save',
+    'restore', 'saveundo', 'restoreundo', 'quit', 'restart', 'protect',
+    'setmemsize', 'malloc', 'mfree', 'accelfunc', 'accelparam', 'throw',
+    'debugtrap')
+
+# Maximum number of memory locations in a side effect summary (functions that
+# write more are assumed to write anywhere):
+max_write_keys = 64
+
+# Minimum number of cases for which a chain of comparisons becomes a switch:
+min_switch_cases = 3
+
+# Maximum number of instructions of functions that are inlined into their
+# callers (see inline.py), unless changed with --inline-budget:
+default_inline_budget = 12
+
+# Glk functions that translated code calls directly for glk instructions with
+# a constant selector and argument count, by selector: the name of the stub in
+# native_glk.c (prefixed with native_glk_) and its number of arguments.
+glk_stubs = {
+    0x0003: ('tick', 0),
+    0x0004: ('gestalt', 2),
+    0x0021: ('window_get_rock', 1),
+    0x0022: ('window_get_root', 0),
+    0x0023: ('window_open', 5),
+    0x0026: ('window_set_arrangement', 4),
+    0x0028: ('window_get_type', 1),
+    0x0029: ('window_get_parent', 1),
+    0x002A: ('window_clear', 1),
+    0x002B: ('window_move_cursor', 3),
+    0x002C: ('window_get_stream', 1),
+    0x002D: ('window_set_echo_stream', 2),
+    0x002E: ('window_get_echo_stream', 1),
+    0x002F: ('set_window', 1),
+    0x0030: ('window_get_sibling', 1),
+    0x0041: ('stream_get_rock', 1),
+    0x0042: ('stream_open_file', 3),
+    0x0045: ('stream_set_position', 3),
+    0x0046: ('stream_get_position', 1),
+    0x0047: ('stream_set_current', 1),
+    0x0048: ('stream_get_current', 0),
+    0x0060: ('fileref_create_temp', 2),
+    0x0062: ('fileref_create_by_prompt', 3),
+    0x0063: ('fileref_destroy', 1),
+    0x0065: ('fileref_get_rock', 1),
+    0x0066: ('fileref_delete_file', 1),
+    0x0067: ('fileref_does_file_exist', 1),
+    0x0068: ('fileref_create_from_fileref', 3),
+    0x0080: ('put_char', 1),
+    0x0081: ('put_char_stream', 2),
+    0x0082: ('put_string', 1),
+    0x0083: ('put_string_stream', 2),
+    0x0084: ('put_buffer', 2),
+    0x0085: ('put_buffer_stream', 3),
+    0x0086: ('set_style', 1),
+    0x0087: ('set_style_stream', 2),
+    0x0090: ('get_char_stream', 1),
+    0x00A0: ('char_to_lower', 1),
+    0x00A1: ('char_to_upper', 1),
+    0x00B0: ('stylehint_set', 4),
+    0x00B1: ('stylehint_clear', 3),
+    0x00D2: ('request_char_event', 1),
+    0x00D3: ('cancel_char_event', 1),
+    0x00D4: ('request_mouse_event', 1),
+    0x00D5: ('cancel_mouse_event', 1),
+    0x00D6: ('request_timer_events', 1),
+    0x0128: ('put_char_uni', 1),
+    0x0129: ('put_string_uni', 1),
+    0x012B: ('put_char_stream_uni', 2),
+    0x0130: ('get_char_stream_uni', 1),
+    0x0140: ('request_char_event_uni', 1) }
+
+# Number of bits of the index into the result cache of each function that is
+# memoized with --memoize (see memo_code()):
+memo_bits = 6
+
+# Maximum number of characters of strings that are decoded at translation time
+# (see decode_string()):
+max_decoded_length = 4096
+
+# Memory keys (see analyze.memory_key()) of the global variables that are kept
+# in C variables with --promote-globals. Translated code reads them from these
+# variables, and writes them to both the variables and memory; after anything
+# else may have written memory, they are reloaded with globals_reload().
+promoted_globals = set()
+
+# Ranges (start, end) of RAM that were never written in a profiling run, read
+# with --frozen-ram (see read_frozen_ram()). Loads from these are folded like
+# loads from ROM, and the runtime keeps their pages read-only, so that a write
+# traps instead of making the folded values stale (see native_frozen.c).
+frozen_ram = []
+
+# Execution profile read with --profile (see read_profile()): counts by kind
+# and story file offset, as in native_profile.c, and for each call site with a
+# computed address, the number of calls to each target.
+profile_counts = {}
+profile_calls = {}
+
+# Branches and call sites executed fewer times than this are not optimized
+# for the profile:
+profile_min_count = 100
+
+# Share of executions in which a branch must go the same way, or a call site
+# call the same function, for translated code to expect it:
+profile_bias = 0.9
+
+# Functions are hot if they are among the most frequently entered functions
+# that together account for this share of all function entries. Their inline
+# budget is multiplied by hot_inline_factor. Functions that were never entered
+# are cold, and not inlined:
+profile_hot_share = 0.9
+hot_inline_factor = 2
+
+# Instructions after which promoted global variables are reloaded, since they
+# may write memory (or return from catch or save after memory was changed).
+# Instructions that only print do so only while a memory stream is open (see
+# prints_only()):
+globals_reload_ops = ('glk', 'streamchar', 'streamunichar', 'streamnum',
+    'streamstr', 'save', 'saveundo', 'restore', 'restoreundo', 'catch')
+
+# Memory written by instructions with dynamic addresses, as C expressions for
+# the start address and size in terms of the variables of their templates:
+dynamic_store_ranges = {
+    'astore':    ('l1 + 4*l2', '4'),
+    'astores':   ('l1 + 2*l2', '2'),
+    'astoreb':   ('l1 + l2',   '1'),
+    'astorebit': ('a',         '1'),
+    'mzero':     ('l2',        'l1'),
+    'mcopy':     ('l3',        'l1') }
+
+def prints_only(instr):
+    '''Returns whether `instr' can only write memory by printing text to a
+       memory stream: it's a stream instruction, or a glk instruction that
+       calls a Glk function without reference or array arguments.'''
+    if instr.mnemonic in ('streamchar', 'streamunichar', 'streamnum',
+                          'streamstr'):
+        return True
+    return instr.mnemonic == 'glk' and instr.operands[0].is_immediate() and \
+        instr.operands[0].value() & 0xffffffff in stack_neutral_glk
+
 def read_opcode_map():
     global opcode_map
 
@@ -44,6 +214,355 @@ def getter(size):
     if size == 'f': return 'get_long'
     assert 0
 
+def rom_value(data, ramstart, addr, size):
+    '''Returns the value of the given size stored at `addr' if it lies in ROM
+       or frozen RAM (which cannot change at run time), or None otherwise.'''
+    n = { 'B': 1, 'b': 1, 'S': 2, 's': 2, 'L': 4, 'l': 4, 'f': 4 }[size]
+    if not (0 <= addr and addr + n <= min(ramstart, len(data))) and \
+            not [ r for r in frozen_ram if r[0] <= addr and addr + n <= r[1] ]:
+        return None
+    if size in 'bsl':
+        return unpacks(data, addr, n)
+    else:
+        return unpack(data, addr, n)
+
+def rom_array_value(data, ramstart, instr):
+    '''Returns the value loaded by an aload instruction with immediate
+       operands if it lies in ROM, or None otherwise.'''
+    if not (instr.operands[0].is_immediate() and
+            instr.operands[1].is_immediate()):
+        return None
+    base  = instr.operands[0].value() & 0xffffffff
+    index = instr.operands[1].value() & 0xffffffff
+    if instr.mnemonic == 'aload':
+        return rom_value(data, ramstart, (base + 4*index) & 0xffffffff, 'L')
+    if instr.mnemonic == 'aloads':
+        return rom_value(data, ramstart, (base + 2*index) & 0xffffffff, 'S')
+    if instr.mnemonic == 'aloadb':
+        return rom_value(data, ramstart, (base + index) & 0xffffffff, 'B')
+    if instr.mnemonic == 'aloadbit':
+        if index >= 0x80000000:
+            index -= 0x100000000
+        b = index & 7
+        v = rom_value(data, ramstart, (base + (index - b)//8) & 0xffffffff, 'B')
+        if v is not None:
+            v = (v >> b) & 1
+        return v
+    return None
+
+def read_frozen_ram(path, data, header):
+    '''Reads the ranges of RAM that were never written from the file written
+       by a profiling run (see native_frozen.c), with one range per line as
+       hexadecimal start and end offsets. Ranges that don't lie within the
+       initialized part of RAM are skipped.'''
+    ranges = []
+    for line in file(path):
+        if not line.strip(): continue
+        start, end = [ int(x, 16) for x in line.split() ]
+        if header.ramstart <= start < end <= min(header.extstart, len(data)):
+            ranges.append((start, end))
+        else:
+            print >>sys.stderr, 'Skipping frozen RAM range %08x-%08x' % \
+                (start, end)
+    return ranges
+
+def read_profile(path, header):
+    '''Reads the profile saved by a run of instrumented translated code (see
+       native_profile.c) into profile_counts and profile_calls. The profile
+       is ignored if it was made for a story with a different checksum.'''
+    counts, calls = {}, {}
+    for line in file(path):
+        fields = line.split()
+        if not fields: continue
+        if fields[0] == 'checksum':
+            if int(fields[1], 16) != header.checksum:
+                print >>sys.stderr, 'Ignoring profile of another story file'
+                return
+        elif fields[0] == 'c':
+            site, target, count = [ int(x, 16) for x in fields[1:3] ] + \
+                                  [ int(fields[3]) ]
+            targets = calls.setdefault(site, {})
+            targets[target] = targets.get(target, 0) + count
+        else:
+            key = (fields[0], int(fields[1], 16))
+            counts[key] = counts.get(key, 0) + int(fields[2])
+    profile_counts.update(counts)
+    profile_calls.update(calls)
+
+def function_heat(functions):
+    '''Returns a dictionary that maps functions to 'hot' or 'cold' according
+       to the profile (see profile_hot_share), or an empty one without it.'''
+    if not profile_counts:
+        return {}
+    entries = sorted([ (profile_counts.get(('f', f.offset()), 0), f)
+                       for f in functions ],
+                     key = lambda (n, f): (-n, f.offset()))
+    total = sum([ n for (n, f) in entries ])
+    heat, covered = {}, 0
+    for (n, f) in entries:
+        if n == 0:
+            heat[f] = 'cold'
+        elif covered < profile_hot_share*total:
+            heat[f] = 'hot'
+            covered += n
+    return heat
+
+def expected_branch(instr):
+    '''Returns 1 if conditional branch `instr' was almost always taken in the
+       profile, 0 if it almost never was, or None otherwise.'''
+    n = profile_counts.get(('b', instr.origin), 0)
+    taken = profile_counts.get(('t', instr.origin), 0)
+    if n < profile_min_count:
+        return None
+    if taken >= profile_bias*n:
+        return 1
+    if n - taken >= profile_bias*n:
+        return 0
+    return None
+
+def speculative_target(instr, func_map):
+    '''Returns the local-argument function that call instruction `instr' to a
+       computed address almost always called in the profile, if it can be
+       called directly, or None otherwise.'''
+    if instr.mnemonic == 'call' and not instr.operands[1].is_immediate():
+        return None
+    targets = profile_calls.get(instr.origin, {})
+    if sum(targets.values()) < profile_min_count:
+        return None
+    (count, target) = max([ (n, t) for (t, n) in targets.items() ])
+    if count < profile_bias*sum(targets.values()) or \
+            not (0 <= target < len(func_map)*4):
+        return None
+    f = func_map[target//4]
+    if f is None or f.offset() != target or f.type != 0xc1 or f.accelerated:
+        return None
+    return f
+
+def decode_string(data, ramstart, offset, decoding_tbl):
+    '''Returns the characters of the string object at `offset', as decoded
+       with the string table at `decoding_tbl', or None if the string can't
+       be decoded at translation time: if the string or the parts of the
+       table it uses may change at run time, or if it contains references
+       to other strings or functions.'''
+    def get(addr, size):
+        v = rom_value(data, ramstart, addr & 0xffffffff, size)
+        if v is None:
+            raise ValueError(addr)
+        return v
+    def get_chars(addr, size):
+        chars = []
+        while len(chars) <= max_decoded_length:
+            c = get(addr, size)
+            if c == 0:
+                return chars
+            chars.append(c)
+            addr += { 'B': 1, 'L': 4 }[size]
+        raise ValueError(addr)
+
+    try:
+        type = get(offset, 'B')
+        if type == 0xe0:
+            return get_chars(offset + 1, 'B')
+        if type == 0xe2:
+            return get_chars(offset + 4, 'L')
+        if type != 0xe1 or decoding_tbl == 0:
+            return None
+        chars, addr, bits, value = [], offset + 1, 0, 0
+        root = get(decoding_tbl + 8, 'L')
+        while len(chars) <= max_decoded_length:
+            node = root
+            while get(node, 'B') == 0:
+                if bits == 0:
+                    value, bits = get(addr, 'B'), 8
+                    addr += 1
+                node = get(node + (5 if value & 1 else 1), 'L')
+                value >>= 1
+                bits -= 1
+            type = get(node, 'B')
+            if type == 0x01:
+                return chars
+            elif type == 0x02:
+                chars.append(get(node + 1, 'B'))
+            elif type == 0x03:
+                chars += get_chars(node + 1, 'B')
+            elif type == 0x04:
+                chars.append(get(node + 1, 'L'))
+            elif type == 0x05:
+                chars += get_chars(node + 1, 'L')
+            else:
+                return None  # indirect reference
+        return None
+    except ValueError:
+        return None
+
+def glk_stub(instr):
+    '''Returns the pair (name, number of arguments) from glk_stubs for glk
+       instruction `instr', or None if it must go through native_glk().'''
+    selector, narg = instr.operands[0], instr.operands[1]
+    if not (selector.is_immediate() and narg.is_immediate()):
+        return None
+    stub = glk_stubs.get(selector.value() & 0xffffffff)
+    if stub is None or stub[1] != narg.value():
+        return None
+    return stub
+
+def string_literal(chars):
+    '''Returns a C string literal for a list of Latin-1 characters.'''
+    res = ''
+    for c in chars:
+        if 32 <= c < 127 and chr(c) not in '"\\?':
+            res += chr(c)
+        else:
+            res += '\\%03o' % c
+    return '"%s"' % res
+
+def mem_var(key):
+    '''Returns the name of the C variable that holds the memory value with the
+       given key (see analyze.memory_key()).'''
+    return 'm%d_%08x' % (key[1], key[0])
+
+def global_var(key):
+    return 'global_%08x' % key[0]
+
+def promotable_globals(keys, ramstart, endmem):
+    '''Returns the subset of memory keys `keys' of all constant-address memory
+       operands that refer to 4-byte global variables that can be kept in C
+       variables: aligned words in RAM that are never accessed with a
+       different size or alignment.'''
+    sizes = {}
+    for (addr, n) in keys:
+        sizes.setdefault(addr, []).append(n)
+    promotable = set()
+    for (addr, n) in keys:
+        if sizes[addr] == [4] and addr%4 == 0 and \
+                ramstart <= addr and addr + 4 <= endmem and \
+                not [ a for a in range(addr - 3, addr + 4)
+                      if a != addr and a in sizes ]:
+            promotable.add((addr, n))
+    return promotable
+
+def mem_getter(key):
+    return { 1: 'get_byte', 2: 'get_shrt', 4: 'get_long' }[key[1]]
+
+def mem_addr(addr, ramstart):
+    if addr >= ramstart:
+        return '%d + RAMSTART' % (addr - ramstart)
+    return '%d' % addr
+
+def load_expr(func, o, size, data, ramstart, avail = None):
+    '''Returns a C expression that loads operand `o' of the given size in
+       translated function `func'. If `avail' is given, it is the set of memory
+       keys whose values are held in C variables, which is updated for memory
+       loads.'''
+    t = int_type(size)
+    if o.is_immediate():
+        v = str(o.value())
+        if size in 'LSBf': v += 'u'
+    elif o.is_mem_ref() and \
+            rom_value(data, ramstart, o.value()&0xffffffff, size) is not None:
+        v = str(rom_value(data, ramstart, o.value()&0xffffffff, size))
+        if size in 'LSBf': v += 'u'
+    elif o.is_ram_ref() and rom_value(data, ramstart,
+            (ramstart + o.value())&0xffffffff, size) is not None:
+        v = str(rom_value(data, ramstart, (ramstart + o.value())&0xffffffff, size))
+        if size in 'LSBf': v += 'u'
+    elif memory_key(o, size, ramstart) in promoted_globals:
+        v = global_var(memory_key(o, size, ramstart))
+        if size == 'l':
+            v = '(int32_t)%s' % v
+    elif avail is not None and \
+            memory_key(o, size, ramstart) in func.mem_vars:
+        key = memory_key(o, size, ramstart)
+        v = mem_var(key)
+        if key not in avail:
+            avail.add(key)
+            v = '(%s = %s(%s))' % (v, mem_getter(key),
+                                   mem_addr(key[0], ramstart))
+        if size in 'lsb':
+            v = '(%s)%s' % (int_type(size), v)
+    elif o.is_mem_ref():
+        v = '%s(%d)' % (getter(size), o.value()&0xffffffff)
+    elif o.is_ram_ref():
+        v = '%s(%d + RAMSTART)' % (getter(size), o.value())
+    elif o.is_local_ref():
+        assert o.value()%4 == 0
+        v = 'loc%d' % (o.value()//4)
+    elif o.is_stack_ref():
+        if not func.stack_refs:
+            v = '(%s)*--sp' % (t,)
+        elif float_var(func, o):
+            v = sp_name(o.value())
+        else:
+            v = '(%s)%s' % (t, sp_name(o.value()))
+    else:
+        assert 0
+    if float_var(func, o) and size != 'f':
+        v = '(%s)float_to_long(%s)' % (t, v)
+    return v
+
+def float_var(func, o):
+    '''Returns whether operand `o' refers to a local variable or stack location
+       of translated function `func' that is declared as float.'''
+    if o.is_local_ref():
+        return o.value()//4 in func.float_locals
+    if o.is_stack_ref() and func.stack_refs:
+        return o.value() in func.float_slots
+    return False
+
+def float_variables(func, instrs):
+    '''Returns a pair of sets of the local variables and stack locations of
+       translated function `func' that are used only as floating-point
+       operands, apart from being set to constants. These are declared as
+       float, so that their values stay in floating-point registers instead
+       of being converted for every instruction.'''
+    if func.has_catch:
+        return set(), set()
+    float_use, other_use = set(), set()
+    for instr in instrs:
+        (param, sizes, code) = opcode_map[instr.mnemonic]
+        for o, p, s in zip(instr.operands, param, sizes):
+            if o.is_local_ref():
+                var = ('loc', o.value()//4)
+            elif o.is_stack_ref() and func.stack_refs:
+                var = ('sp', o.value())
+            else:
+                continue
+            if s == 'f':
+                float_use.add(var)
+            elif not (instr.mnemonic == 'copy' and p == 's' and
+                      instr.operands[0].is_immediate()):
+                other_use.add(var)
+
+        # Stack locations passed to calls or moved by stack instructions
+        # are accessed as integers (see stack_call_args() and
+        # stack_instr_code()):
+        if func.stack_refs and instr.mnemonic in ('call', 'tailcall', 'glk'):
+            other_use.update([ ('sp', i)
+                               for i in range(instr.sp_low, instr.sp) ])
+        if func.stack_refs and instr.mnemonic.startswith('stk'):
+            top = instr.stk_sp
+            if instr.mnemonic == 'stkcopy':
+                top += instr.operands[0].value()
+            other_use.update([ ('sp', i)
+                               for i in range(instr.stk_low, top) ])
+
+    float_vars = float_use - other_use
+    return (set([ n for (k, n) in float_vars if k == 'loc' ]),
+            set([ i for (k, i) in float_vars if k == 'sp' and i >= 0 ]))
+
+def interp_state(func):
+    '''Returns the arguments that pass the locals and stack of translated
+       function `func' to native_interp_resume().'''
+    assert func.stack_refs is None
+    assert not func.inlined_locals  # see inline.py
+    if func.nlocal == 0:
+        locs = 'NULL'
+    else:
+        locs = '(const uint32_t[]){ %s }' % \
+            ', '.join([ ('float_to_long(loc%d)' if n in func.float_locals
+                         else 'loc%d') % n for n in range(func.nlocal) ])
+    return '%s, %d, bp, sp' % (locs, func.nlocal)
+
 def setter(size):
     if size in ('B', 'b'): return 'set_byte'
     if size in ('S', 's'): return 'set_shrt'
@@ -54,7 +573,385 @@ def setter(size):
 def sp_name(i):
     return ('sp_%d'%i).replace('-', 'n')
 
-def main(path = None):
+def local_decl(func, n):
+    # Local variables may be modified between catch and throw, so they must
+    # not be kept in registers that context_restore() resets:
+    if func.has_catch:
+        return 'volatile uint32_t loc%d' % n
+    if n in func.float_locals:
+        return 'float loc%d' % n
+    return 'uint32_t loc%d' % n
+
+def param_name(func, n):
+    # Float locals are passed as integers, and converted on entry:
+    if n in func.float_locals:
+        return 'loc%d_bits' % n
+    return 'loc%d' % n
+
+def param_decl(func, n):
+    if n in func.float_locals:
+        return 'uint32_t %s' % param_name(func, n)
+    return local_decl(func, n)
+
+def direct_call(f, args):
+    '''Returns a C expression that calls the _args() version of local-argument
+       function `f' with the given argument expressions. Missing arguments are
+       passed as zero; surplus arguments are dropped.'''
+    args = args[:f.nlocal] + ['0']*(f.nlocal - len(args))
+    return '%s_args(%s)' % (func_name(f), ', '.join(f.needs_sp*['sp'] + args))
+
+def uses_sp(instr, filter_iosys):
+    '''Returns whether the code for non-call instruction `instr' uses the data
+       stack pointer.'''
+    if instr.mnemonic in filter_stream_ops and not filter_iosys:
+        return False
+    (_, _, code) = opcode_map[instr.mnemonic]
+    return re.search(r'\bsp\b', code) is not None
+
+def writes_memory(instr):
+    '''Returns whether `instr' may write to memory, other than through its
+       stored operands.'''
+    if instr.is_call():
+        return True
+    if instr.mnemonic == 'jumpabs':
+        return False  # translated to a goto, or leaves the function
+    (_, _, code) = opcode_map[instr.mnemonic]
+    if not code:
+        return True
+    for name in re.findall(r'\b(\w+)\s*\(', code):
+        if name not in memory_safe_calls + ('if', 'for', 'while', 'return'):
+            return True
+    return False
+
+def reads_only_rom(instr, data, ramstart):
+    '''Returns whether non-call instruction `instr' reads no memory other
+       than ROM, and no other state of the virtual machine besides its
+       operands.'''
+    (param, sizes, code) = opcode_map[instr.mnemonic]
+    for o, p, s in zip(instr.operands, param, sizes):
+        key = memory_key(o, s, ramstart)
+        if p == 'l' and key is not None and \
+                rom_value(data, ramstart, key[0], s) is None:
+            return False
+    if instr.mnemonic.startswith('aload') and \
+            rom_array_value(data, ramstart, instr) is not None:
+        return True
+    if instr.mnemonic == 'gestalt':
+        # The start of the heap (selector 8) changes with malloc and mfree:
+        return instr.operands[0].is_immediate() and \
+            instr.operands[0].value() != 8
+    for name in re.findall(r'\b(\w+)\s*\(', code):
+        if name not in pure_calls + ('if', 'for', 'while', 'return'):
+            return False
+    return True
+
+def memo_code(func):
+    '''Returns C code for the _args() version of memoized function `func',
+       which looks up its arguments in the function's result cache, and calls
+       the _eval() version on a miss.'''
+    name = func_name(func)
+    params = [ param_name(func, n) for n in range(func.nlocal) ]
+    code = '\tuint32_t hash = 0, value;\n'
+    for p in params:
+        code += '\thash = ((hash << 5 | hash >> 27) ^ %s)*0x9e3779b1u;\n' % p
+    code += '\tstruct Memo%08x *entry = &memo_%08x[hash >> (32 - MEMO_BITS)];\n' \
+        % (func.offset(), func.offset())
+    code += '\tif (entry->valid%s)\n' % ''.join([ ' && entry->key[%d] == %s'
+        % (n, p) for (n, p) in enumerate(params) ])
+    code += '\t{\n'
+    code += '\t\t++memo_%08x_hits;\n' % func.offset()
+    code += '\t\treturn entry->value;\n'
+    code += '\t}\n'
+    code += '\t++memo_%08x_misses;\n' % func.offset()
+    code += '\tvalue = %s_eval(%s);\n' % (name,
+        ', '.join(func.needs_sp*['sp'] + params))
+    # The entry is filled in after the call, which may have used it too:
+    code += '\tentry->valid = 1;\n'
+    for (n, p) in enumerate(params):
+        code += '\tentry->key[%d] = %s;\n' % (n, p)
+    code += '\tentry->value = value;\n'
+    code += '\treturn value;'
+    return code
+
+def call_target_function(instr, func_map):
+    '''Returns the translated function that call instruction `instr' always
+       calls, or None if it isn't known at translation time.'''
+    target = instr.call_target()
+    if target is None or not (0 <= target < len(func_map)*4):
+        return None
+    f = func_map[target//4]
+    if f is None or f.accelerated:
+        return None
+    return f
+
+def leaves_function(instr, instrs):
+    '''Returns whether `instr' continues execution in the interpreter.'''
+    if instr.mnemonic == 'jumpabs':
+        return instr.branch_target() not in [ i.offset() for i in instrs ]
+    return instr.is_branch() and instr.branch_target() is None and \
+           instr.return_value() is None
+
+def stack_args_call_target(instr, func_map):
+    '''Returns the function called by `instr' if it is a stack-argument
+       function that can be called directly instead of through func_table[],
+       or None otherwise.'''
+    target = instr.call_target()
+    if target is None or not (0 <= target < len(func_map)*4):
+        return None
+    f = func_map[target//4]
+    if f is None or f.type != 0xc0 or f.accelerated:
+        return None
+    return f
+
+def direct_call_target(instr, func_map):
+    '''Returns the function called by `instr' if it can be called directly
+       through its _args() version, or None otherwise.'''
+    target = instr.call_target()
+    if target is None or not (0 <= target < len(func_map)*4):
+        return None
+    f = func_map[target//4]
+    if f is None or f.type != 0xc1 or f.accelerated:
+        return None
+    return f
+
+def stack_call_args(func, instr, n):
+    '''Returns a pair (code, args) where `code' pops `n' call arguments off the
+       stack for `instr' and `args' are the C expressions for the arguments,
+       first argument first.'''
+    if func.stack_refs is not None:
+        h = instr.sp
+        return '', [ sp_name(h - 1 - i) for i in range(n) ]
+    else:
+        return 'sp -= %d; ' % n, [ 'sp[%d]'%(n - 1 - i) for i in range(n) ]
+
+def stack_instr_code(func, instr):
+    '''Returns C code for a stack manipulation instruction with immediate
+       operands in a function whose stack locations are C variables.'''
+    h = instr.stk_sp
+    args = [ o.value() & 0xffffffff for (o, p) in
+             zip(instr.operands, instr.parameters) if p == 'l' ]
+    if instr.mnemonic == 'stkcount':
+        if func.type == 0xc0:
+            return 's1 = sp - bp + %d;' % h
+        else:
+            return 's1 = %d;' % h
+    if instr.mnemonic == 'stkpeek':
+        return 's1 = %s;' % sp_name(h - 1 - args[0])
+    if instr.mnemonic == 'stkswap':
+        return 'uint32_t tmp = %s; %s = %s; %s = tmp;' % (
+            sp_name(h - 1), sp_name(h - 1), sp_name(h - 2), sp_name(h - 2))
+    if instr.mnemonic == 'stkcopy':
+        n = args[0]
+        return ' '.join([ '%s = %s;' % (sp_name(h + i), sp_name(h - n + i))
+                          for i in range(n) ])
+    if instr.mnemonic == 'stkroll':
+        size, steps = args
+        if steps >= 0x80000000:
+            steps -= 0x100000000
+        if size == 0 or steps%size == 0:
+            return ''
+        # element i moves to position (i + steps) % size:
+        slots = [ sp_name(h - size + i) for i in range(size) ]
+        code = 'uint32_t %s; ' % ', '.join(
+            [ 't%d = %s'%(i, slot) for (i, slot) in enumerate(slots) ])
+        code += ' '.join([ '%s = t%d;' % (slots[(i + steps)%size], i)
+                           for i in range(size) ])
+        return code
+    assert 0
+
+def local_comparison(instr):
+    '''If `instr' branches depending on whether a local variable equals a
+       constant, returns a tuple (operand index, local, value, equal, unequal)
+       where `equal' and `unequal' say where execution continues in either
+       case, as ('goto', offset) or ('return', value). Returns None otherwise.'''
+    if instr.mnemonic not in ('jeq', 'jne', 'jz', 'jnz'):
+        return None
+    args = instr.operands[:-1]
+    values = [ o.value() & 0xffffffff for o in args if o.is_immediate() ]
+    if instr.mnemonic in ('jz', 'jnz'):
+        values.append(0)
+    locals = [ n for (n, o) in enumerate(args) if o.is_local_ref() ]
+    if len(locals) != 1 or len(values) != 1:
+        return None
+    if instr.branch_target() is not None:
+        taken = ('goto', instr.branch_target())
+    elif instr.return_value() is not None:
+        taken = ('return', instr.return_value())
+    else:
+        return None
+    fall = ('goto', instr.offset() + len(instr))
+    n = locals[0]
+    if instr.mnemonic in ('jeq', 'jz'):
+        return (n, args[n].value(), values[0], taken, fall)
+    else:
+        return (n, args[n].value(), values[0], fall, taken)
+
+def switch_chain(instr, instr_at):
+    '''Follows a chain of comparisons of the same local variable with
+       constants, starting at `instr', where each comparison continues with the
+       next one if the values are unequal. (Inform compiles switch statements
+       and `x == a or b or c' conditions to such chains.) Returns a tuple
+       (operand index, cases, default, members), where `cases' is a list of
+       (value, continuation) pairs, `default' is the continuation if no value
+       matches and `members' are the instructions in the chain. Returns None if
+       `instr' doesn't start such a chain.'''
+    cmp = local_comparison(instr)
+    if cmp is None:
+        return None
+    index, local = cmp[0], cmp[1]
+    cases, members = [], []
+    while True:
+        (_, _, value, equal, unequal) = cmp
+        members.append(instr)
+        if value not in [ v for (v, c) in cases ]:
+            cases.append((value, equal))
+        if unequal[0] != 'goto' or unequal[1] not in instr_at:
+            break
+        instr = instr_at[unequal[1]]
+        cmp = local_comparison(instr)
+        if cmp is None or cmp[1] != local or instr in members:
+            break
+    for (v, c) in cases + [(None, unequal)]:
+        if c[0] == 'goto' and c[1] not in instr_at:
+            return None
+    return (index, cases, unequal, members)
+
+def continuation_code(c, instr_at):
+    '''Returns C code that continues execution as given by a continuation
+       returned by local_comparison().'''
+    if c[0] == 'return':
+        return 'return %d;' % c[1]
+    if instr_at[c[1]].mem_preload:
+        return 'goto h%08x;' % c[1]
+    return 'goto a%08x;' % c[1]
+
+def loop_idiom_code(func, instr, data, ramstart):
+    '''Returns C code for the header of a loop that is replaced by a native
+       kernel (see find_loop_idioms()). The header's operands, the index and
+       the bound, are loaded as usual, and b1 leaves the loop.'''
+    (kind, size, index, operands, exit) = instr.loop_idiom
+    if instr.mnemonic in ('jge', 'jgeu'):
+        i, n = 'l1', 'l2'
+    else:
+        i, n = 'l2', 'l1'
+    if instr.mnemonic in ('jge', 'jle'):
+        code = 'uint32_t count = (int32_t)%s < (int32_t)%s ? %s - %s : 0; ' \
+            % (i, n, n, i)
+    else:
+        code = 'uint32_t count = %s < %s ? %s - %s : 0; ' % (i, n, n, i)
+    a, b = [ load_expr(func, o, 'L', data, ramstart) for o in operands ]
+    a = '%s + %d*%s' % (a, size, i)
+    if kind == 'copy':
+        b = '%s + %d*%s' % (b, size, i)
+        code += 'native_loop_copy(%s, %s, count, %d); ' % (a, b, size)
+    elif kind == 'fill':
+        code += 'native_loop_fill(%s, %s, count, %d); ' % (a, b, size)
+    elif kind in ('find', 'skip'):
+        code += 'uint32_t found = native_loop_find(%s, %s, count, %d, %d); ' \
+            % (a, b, size, kind == 'find')
+    elif kind == 'compare':
+        b = '%s + %d*%s' % (b, size, i)
+        code += 'uint32_t found = native_loop_compare(%s, %s, count, %d); ' \
+            % (a, b, size)
+    else:
+        assert 0
+    if kind in ('copy', 'fill'):
+        if promoted_globals:
+            code += 'if (GLOBALS_OVERLAP(%s, %d*count)) globals_reload(); ' \
+                % (a, size)
+        code += 'loc%d = %s + count; b1;' % (index, i)
+    else:
+        # The element that ended the search leaves through the exit branch:
+        code += 'loc%d = %s + found; if (found < count) ' % (index, i)
+        if exit.branch_target() is not None:
+            code += 'goto %s%08x; ' % ('ah'[exit.mem_preheader],
+                                       exit.branch_target())
+        else:
+            code += 'return %d; ' % exit.return_value()
+        code += 'b1;'
+    return code
+
+def tailcall_kind(func, instr, func_map):
+    '''Classifies a tailcall instruction in function `func' as:
+        'self'        tail call to `func' itself, which is compiled as a loop
+        'direct'      direct call to a function that doesn't need a trampoline
+        'trampoline'  tail call through the trampoline (see below)'''
+    target = None
+    if instr.operands[1].is_immediate():
+        target = direct_call_target(instr, func_map)
+    if target is func and \
+            (not func.stack_refs or min(func.stack_refs) >= 0):
+        return 'self'
+    if target is not None and not target.trampolined:
+        return 'direct'
+    return 'trampoline'
+
+def tailcall_target(instr, func_map):
+    '''Returns the function that a trampolined tail call should call through
+       its tail call entry point, or None if it must be looked up at runtime.'''
+    target = instr.call_target()
+    if target is None or not (0 <= target < len(func_map)*4):
+        return None
+    f = func_map[target//4]
+    if f is None or f.accelerated or not f.trampolined:
+        return None
+    return f
+
+def tail_entry_name(f):
+    if f.type == 0xc1:
+        return '%s_tail' % func_name(f)
+    else:
+        return '%s_body' % func_name(f)
+
+def stored_addresses(data, addrs, code_ranges):
+    '''Returns the subset of `addrs' that occur as 32-bit values at any byte
+       offset in `data', outside the given (start, end) ranges of code.'''
+    segments, pos = [], 0
+    for (start, end) in sorted(code_ranges):
+        if start > pos:
+            segments.append(data[pos:start])
+        pos = max(pos, end)
+    segments.append(data[pos:])
+    data = '\0\0\0\0'.join(segments)
+    found = set()
+    for shift in range(4):
+        n = (len(data) - shift)//4
+        found.update(addrs.intersection(
+            struct.unpack_from('!%dI' % n, data, shift)))
+    return found
+
+def reachable_functions(data, header, functions, instructions, roots):
+    '''Returns the set of functions that the story may call: the start
+       function and other functions at the addresses in `roots', functions
+       whose addresses are stored in the story file outside of code (in data
+       structures and the string table), and functions whose addresses are
+       immediate operands of reachable code.'''
+    instrs_of = dict(zip(functions, instructions))
+    func_at = dict([ (f.offset(), f) for f in functions ])
+    code_ranges = [ (f.offset(), max([ f.offset() + len(f) ] +
+                                     [ i.offset() + len(i) for i in instrs ]))
+                    for (f, instrs) in zip(functions, instructions) ]
+    todo = [ func_at[a] for a in stored_addresses(data, set(func_at),
+                                                  code_ranges) ]
+    for addr in [ header.start_func ] + list(roots):
+        if addr in func_at:
+            todo.append(func_at[addr])
+    reachable = set()
+    while todo:
+        f = todo.pop()
+        if f in reachable:
+            continue
+        reachable.add(f)
+        for instr in instrs_of[f]:
+            for o in instr.operands:
+                if o.is_immediate() and o.value() & 0xffffffff in func_at:
+                    todo.append(func_at[o.value() & 0xffffffff])
+    return reachable
+
+def main(path = None, promote_globals = False,
+         inline_budget = default_inline_budget, keep_unused = False,
+         memoize = False, frozen_ram_path = None, profile_instrument = False,
+         profile_path = None):
     read_opcode_map()
 
     if path is not None:
@@ -65,6 +962,12 @@ def main(path = None):
 
     ops = glulxd.disassemble(data)
     header = ops[0]
+    if frozen_ram_path is not None:
+        frozen_ram[:] = read_frozen_ram(frozen_ram_path, data, header)
+        print >>sys.stderr, 'Folding loads from %d bytes of frozen RAM' % \
+            sum([ end - start for (start, end) in frozen_ram ])
+    if profile_path is not None:
+        read_profile(profile_path, header)
     functions    = []
     instructions = []
     for o in ops:
@@ -73,11 +976,66 @@ def main(path = None):
             instructions.append([])
         if isinstance(o, Instr):
             instructions[-1].append(o)
+            o.origin, o.inline_entry = o.offset(), None  # see inline.py
+
+    # The filter I/O system calls a Glulx function for every character printed,
+    # which requires a data stack pointer. If the story can't select it, the
+    # runtime doesn't support it either, so that printing doesn't need one.
+    # All functions are scanned, since functions omitted below still run in
+    # the interpreter if the story calls them anyway:
+    filter_iosys = False
+    for instrs in instructions:
+        for instr in instrs:
+            if instr.mnemonic == 'setiosys':
+                o = instr.operands[0]
+                if not o.is_immediate() or o.value() == 1:
+                    filter_iosys = True
+
+    # Functions that may be replaced by accelerated versions at runtime must
+    # always be called through func_table[], not directly. (As above, all
+    # functions are scanned for accelfunc instructions.)
+    accelerated = set()
+    for instrs in instructions:
+        for instr in instrs:
+            if instr.mnemonic == 'accelfunc':
+                o = instr.operands[1]
+                if o.is_immediate() and 0 <= o.value() < header.ramstart:
+                    accelerated.add(o.value())
+
+    # The disassembler finds functions by scanning all of ROM, which includes
+    # false positives as well as library functions the story never uses.
+    # Functions that can't be called are not translated; should the story
+    # compute the address of one anyway, the interpreter runs it. Functions
+    # that may be accelerated are kept, since the runtime can only replace
+    # functions that are in func_table[]:
+    if not keep_unused:
+        reachable = reachable_functions(data, header, functions, instructions,
+                                        accelerated)
+        if len(reachable) < len(functions):
+            print >>sys.stderr, 'Omitting %d of %d functions as unreachable' % \
+                (len(functions) - len(reachable), len(functions))
+        instructions = [ instrs for (f, instrs) in zip(functions, instructions)
+                         if f in reachable ]
+        functions = [ f for f in functions if f in reachable ]
 
     func_map = [ None ] * (header.ramstart//4)
     for f in functions:
         assert func_map[f.offset()//4] is None
         func_map[f.offset()//4] = f
+        f.accelerated = False
+    for addr in accelerated:
+        if func_map[addr//4] is not None:
+            func_map[addr//4].accelerated = True
+
+    # Inline small functions, before their instructions are analyzed. Inlined
+    # instructions get offsets past the end of memory. With a profile, hot
+    # functions get a larger budget, and cold ones aren't inlined:
+    heat = function_heat(functions)
+    budgets = {}
+    for (f, h) in heat.items():
+        budgets[f] = { 'hot': hot_inline_factor*inline_budget, 'cold': 0 }[h]
+    inline_functions(functions, instructions, func_map, inline_budget,
+                     header.endmem, budgets)
 
     for (f, instrs) in zip(functions, instructions):
         f.needs_sp = True
@@ -85,28 +1043,208 @@ def main(path = None):
         # so they can be replaced with local variable references)
         f.stack_refs = optimize(instrs)
 
+    # Type inference: variables that only hold floating-point values are
+    # declared as float (see float_variables()):
+    for (f, instrs) in zip(functions, instructions):
+        f.has_catch = 'catch' in [ i.mnemonic for i in instrs ]
+        f.float_locals, f.float_slots = float_variables(f, instrs)
+
+    # Loop idioms: counted loops that copy, fill, search or compare arrays one
+    # element at a time are executed by native kernels instead (see
+    # find_loop_idioms()):
+    for instrs in instructions:
+        find_loop_idioms(instrs)
+
+    # Memory optimization: keeps values of memory operands at constant
+    # addresses in C variables, so they aren't loaded again while they are
+    # known not to have changed (see analyze_memory()):
+    for (f, instrs) in zip(functions, instructions):
+        for instr in instrs:
+            (param, sizes, code) = opcode_map[instr.mnemonic]
+            instr.mem_loads, instr.mem_stores = [], []
+            for o, p, s in zip(instr.operands, param, sizes):
+                if p == 'b' and instr.branch_target() is None and \
+                        instr.return_value() is None:
+                    p, s = 'l', 'L'  # indirect branch offset
+                key = memory_key(o, s, header.ramstart)
+                if key is not None and p == 'l':
+                    instr.mem_loads.append(key)
+                if key is not None and p == 's':
+                    instr.mem_stores.append(key)
+            instr.mem_writes = writes_memory(instr)
+            instr.mem_clobbers = []
+
+    # Side effect summaries: for each function, determine which memory it may
+    # write (f.writes: a set of memory keys, or None if it may write anywhere)
+    # and which instructions with effects outside memory it may execute
+    # (f.effects: a set of mnemonics, or None if unknown), including those of
+    # the functions it calls. Functions that leave for the interpreter, or
+    # call functions that aren't known at translation time, may do anything.
+    # Summaries start out empty and grow until they are consistent, which
+    # covers recursive functions too.
+    for f in functions:
+        f.writes = f.effects = frozenset()
+    changed = True
+    while changed:
+        changed = False
+        for (f, instrs) in zip(functions, instructions):
+            writes, effects = f.writes, f.effects
+            for instr in instrs:
+                if writes is not None:
+                    writes = writes.union(instr.mem_stores)
+                if instr.is_call():
+                    g = call_target_function(instr, func_map)
+                    if g is None:
+                        writes = effects = None
+                        break
+                    if g.writes is None:
+                        writes = None
+                    elif writes is not None:
+                        writes = writes.union(g.writes)
+                    if g.effects is None:
+                        effects = None
+                    elif effects is not None:
+                        effects = effects.union(g.effects)
+                elif leaves_function(instr, instrs):
+                    writes = effects = None
+                    break
+                else:
+                    if instr.mem_writes:
+                        writes = None
+                    if instr.mnemonic in external_effect_ops and \
+                            effects is not None:
+                        effects = effects.union([instr.mnemonic])
+            if writes is not None and len(writes) > max_write_keys:
+                writes = None
+            if (writes, effects) != (f.writes, f.effects):
+                f.writes, f.effects = writes, effects
+                changed = True
+
+    # Promoted global variables are loaded from C variables, so they need not
+    # be kept in variables by analyze_memory():
+    if promote_globals:
+        promoted_globals.update(promotable_globals(
+            set([ key for instrs in instructions for instr in instrs
+                      for key in instr.mem_loads + instr.mem_stores ]),
+            header.ramstart, header.endmem))
+        for instrs in instructions:
+            for instr in instrs:
+                instr.mem_loads = [ key for key in instr.mem_loads
+                                    if key not in promoted_globals ]
+
+    # Calls to known functions only clobber the memory their callee writes:
+    for (f, instrs) in zip(functions, instructions):
+        for instr in instrs:
+            if instr.is_call():
+                g = call_target_function(instr, func_map)
+                if g is not None and g.writes is not None:
+                    instr.mem_writes = False
+                    instr.mem_clobbers = sorted(g.writes)
+        analyze_memory(instrs, header.endmem)
+
+        # Keep values in variables only if they are loaded while known:
+        f.mem_vars = set()
+        for instr in instrs:
+            f.mem_vars.update(instr.mem_preload)
+            avail = set(instr.mem_avail)
+            for key in instr.mem_loads:
+                if key in avail:
+                    f.mem_vars.add(key)
+                avail.add(key)
+
+    # Pure functions: functions whose results depend only on their arguments,
+    # since they have no side effects, read only ROM, and call only pure
+    # functions. With --memoize, pure local-argument functions keep their
+    # recent results in a direct-mapped cache (see memo_code()). ROM never
+    # changes, so the caches stay valid for the whole run.
+    for (f, instrs) in zip(functions, instructions):
+        f.pure = f.writes == frozenset() and f.effects == frozenset()
+        for instr in instrs:
+            if f.pure and not instr.is_call() and \
+                    not reads_only_rom(instr, data, header.ramstart):
+                f.pure = False
+    changed = True
+    while changed:
+        changed = False
+        for (f, instrs) in zip(functions, instructions):
+            for instr in instrs:
+                if f.pure and instr.is_call():
+                    g = call_target_function(instr, func_map)
+                    if g is None or not g.pure:
+                        f.pure = False
+                        changed = True
+
+    # Tail calls must not grow the native stack. Tail calls of a function to
+    # itself become loops, and direct tail calls are fine as long as the callee
+    # doesn't tail call other functions in turn. All other tail calls return
+    # to a trampoline loop in the calling function's entry point, which then
+    # calls the target. A function needs such a trampoline if it tail calls an
+    # unknown function, or a function that needs a trampoline itself (which
+    # includes all functions on a cycle of tail calls).
+    for (f, instrs) in zip(functions, instructions):
+        f.tailcalls = [ i for i in instrs if i.mnemonic == 'tailcall' ]
+        f.trampolined = bool(f.tailcalls)
+    changed = True
+    while changed:
+        changed = False
+        for f in functions:
+            if f.trampolined and 'trampoline' not in \
+                    [ tailcall_kind(f, i, func_map) for i in f.tailcalls ]:
+                f.trampolined = False
+                changed = True
+
+    # Determine which tail call entry points are used. Indirect tail calls
+    # look up the entry point with tail_entry(), which covers all functions
+    # that aren't accelerated:
+    indirect_tailcalls = False
+    for f in functions:
+        f.tail_entry = False
+    for f in functions:
+        for i in f.tailcalls:
+            if tailcall_kind(f, i, func_map) == 'trampoline':
+                g = tailcall_target(i, func_map)
+                if g is None:
+                    indirect_tailcalls = True
+                else:
+                    g.tail_entry = True
+    for f in functions:
+        f.tail_entry = f.trampolined and not f.accelerated and \
+                       (f.tail_entry or indirect_tailcalls)
+
     # Try to remove stack pointer argument from functions that don't need it.
-    # These are leaf functions that (after stack optimization) don't change the
-    # stack, and don't call any other functions that require a stack argument:
+    # These are functions that (after stack optimization) don't change the
+    # stack, and only call functions that don't require a stack argument either
+    # (which is determined iteratively, so call chains of any depth can pass
+    # all arguments as C parameters):
     changed = True
     while changed:
         changed = False
         for (f, instrs) in zip(functions, instructions):
-            if f.needs_sp and f.local_args() and f.stack_refs is not None:
+            if f.needs_sp and f.local_args() and f.stack_refs is not None \
+                    and not f.trampolined:
                 for instr in instrs:
+                    if instr.mnemonic == 'tailcall' and \
+                            tailcall_kind(f, instr, func_map) == 'self':
+                        continue
+                    if instr.mnemonic.startswith('stk'):
+                        continue  # see stack_instr_code()
                     if instr.is_call():
-                        target = instr.call_target()
-                        if target is None or func_map[target//4].needs_sp:
-                            break
-                    else:
-                        (_, _, code) = opcode_map[instr.mnemonic]
-                        if 'sp' in code: # FIXME: should match whole words only!
+                        target = direct_call_target(instr, func_map)
+                        if target is None or target.needs_sp:
                             break
+                    elif uses_sp(instr, filter_iosys):
+                        break
                 else:
                     f.needs_sp = False
                     changed = True
 
+    for f in functions:
+        f.memoized = memoize and f.pure and f.type == 0xc1 and \
+                     not f.trampolined and not f.accelerated
+
     print '#include "storycode.h"'
+    if [ f for f in functions if f.memoized ]:
+        print '#include "messages.h"'
     print ''
     print '#define RAMSTART     ((uint32_t)%du)' % header.ramstart
     print '#define EXTSTART     ((uint32_t)%du)' % header.extstart
@@ -124,6 +1262,13 @@ def main(path = None):
     print 'const uint32_t init_decoding_tbl = DECODING_TBL;'
     print 'const uint32_t init_checksum     = CHECKSUM;'
     print ''
+    print 'const uint32_t init_filter_iosys = %d;' % filter_iosys
+    print ''
+    print 'const struct FrozenRange frozen_ram[] = {'
+    for (start, end) in frozen_ram:
+        print '    { 0x%08xu, 0x%08xu },' % (start, end)
+    print '    { 0, 0 } };'
+    print ''
     print 'void *init_start_thunk(void *ctx_out)'
     print '{'
     print '    void *res;'
@@ -133,96 +1278,486 @@ def main(path = None):
     print '    if (res == NULL)'
     print '    {'
     print '        data_stack[0] = 0;'
-    print '        func(init_start_func)(data_stack);'
+    print '        call_func(init_start_func, data_stack);'
     print '    }'
     print '    return res;'
     print '}'
     print ''
 
+    if [ f for f in functions if f.trampolined ]:
+        print '/* Pending tail call, set by functions that return to a trampoline: */'
+        print 'static uint32_t (*tail_func)(uint32_t*);'
+        print 'static uint32_t *tail_sp;'
+        print ''
+        print 'static uint32_t trampoline(uint32_t res)'
+        print '{'
+        print '    while (tail_func != NULL)'
+        print '    {'
+        print '        uint32_t (*f)(uint32_t*) = tail_func;'
+        print '        tail_func = NULL;'
+        print '        res = f(tail_sp);'
+        print '    }'
+        print '    return res;'
+        print '}'
+        print ''
+
+    # Prototypes, with the attributes of hot and cold functions (according
+    # to the profile, if any):
     for f in functions:
-        print 'static uint32_t %s(uint32_t*);' % func_name(f)
+        attr = { 'hot':  ' __attribute__((hot))',
+                 'cold': ' __attribute__((cold))' }.get(heat.get(f), '')
+        print 'static uint32_t %s(uint32_t*)%s;' % (func_name(f), attr)
         if f.type == 0xc1:  # local args
-            print 'static uint32_t %s_args(%s);' % \
+            print 'static uint32_t %s_args(%s)%s;' % \
+                    (func_name(f), ','.join( f.needs_sp*["uint32_t*"] +
+                                             f.nlocal*['uint32_t'] ), attr)
+        if f.memoized:
+            print 'static uint32_t %s_eval(%s)%s;' % \
                     (func_name(f), ','.join( f.needs_sp*["uint32_t*"] +
-                                             f.nlocal*['uint32_t'] ))
+                                             f.nlocal*['uint32_t'] ), attr)
+        if f.trampolined:
+            if f.type == 0xc1:
+                if f.tail_entry:
+                    print 'static uint32_t %s_tail(uint32_t*)%s;' % \
+                        (func_name(f), attr)
+                print 'static uint32_t %s_body(%s)%s;' % \
+                    (func_name(f), ','.join(["uint32_t*"] +
+                                            f.nlocal*['uint32_t'] ), attr)
+            else:
+                print 'static uint32_t %s_body(uint32_t*)%s;' % \
+                    (func_name(f), attr)
     print ''
 
-    print 'uint32_t (* const func_map[RAMSTART/4 + 1])(uint32_t*) = {'
-    line = '\t'
-    for i in range(0, header.ramstart//4):
-        if func_map[i] is None: line += '0, '
-        else:                   line += '&' + func_name(func_map[i]) + ', '
+    # Dispatch table (see storycode.h): translated functions in order of
+    # address, indexed by a bitmap of the 4-byte words where they start:
+    entries = [ f for f in func_map if f is not None ]
+    print 'struct FuncEntry func_table[] = {'
+    for f in entries:
+        print '\t{ %du, &%s },' % (f.offset(), func_name(f))
+    print '\t{ 0xffffffffu, NULL } };'
+    print 'const uint32_t func_count = %d;\n' % len(entries)
+    print 'const struct FuncBlock func_index[] = {'
+    line, first = '\t', 0
+    for i in range(0, len(func_map), 32):
+        bits = 0
+        for (n, f) in enumerate(func_map[i:i + 32]):
+            if f is not None:
+                bits |= 1 << n
+        line += '{ %d, 0x%x }, ' % (first, bits)
+        first += bin(bits).count('1')
         if len(line) > 60:
             print line
             line = '\t'
-    print line + '0 };\n'
-    print '#define func(addr) func_map[addr/4]\n'
+    print line + '{ %d, 0 } };\n' % first
     del line
 
+    if promoted_globals:
+        print '/* Global variables kept in C variables: */'
+        for key in sorted(promoted_globals):
+            print 'static uint32_t %s;' % global_var(key)
+        print ''
+        print '#define GLOBALS_START ((uint32_t)%du)' % min(promoted_globals)[0]
+        print '#define GLOBALS_END   ((uint32_t)%du)' % \
+            (max(promoted_globals)[0] + 4)
+        print '#define GLOBALS_OVERLAP(addr, size) ((uint32_t)(addr) < GLOBALS_END && \\'
+        print '        (uint32_t)(addr) + (uint32_t)(size) > GLOBALS_START)'
+        print ''
+    print 'void globals_reload(void)'
+    print '{'
+    for key in sorted(promoted_globals):
+        print '\t%s = get_long(%s);' % (global_var(key),
+                                        mem_addr(key[0], header.ramstart))
+    print '}\n'
+
+    # Calls to addresses computed at runtime have a monomorphic inline cache,
+    # which holds the function last called from the call site, so the
+    # func_table[] lookup is skipped as long as the target stays the same.
+    # Only translated functions are cached, and the caches are reset when
+    # func_table[] changes (see native_accelfunc()):
+    call_caches = {}
+    for instrs in instructions:
+        for instr in instrs:
+            if instr.mnemonic in ('call', 'callf', 'callfi', 'callfii',
+                                  'callfiii') and instr.call_target() is None:
+                call_caches[instr] = len(call_caches)
+    if call_caches:
+        print 'static struct CallCache'
+        print '{'
+        print '    uint32_t addr;'
+        print '    uint32_t (*target)(uint32_t*);'
+        print '} call_cache[%d] = { [0 ... %d] = { 0xffffffffu, NULL } };' % \
+            (len(call_caches), len(call_caches) - 1)
+        print ''
+        print 'static uint32_t call_cache_miss(struct CallCache *cache, ' \
+              'uint32_t addr, uint32_t *sp)'
+        print '{'
+        print '    uint32_t (*target)(uint32_t*) = func(addr);'
+        print '    if (target != NULL)'
+        print '    {'
+        print '        cache->addr = addr;'
+        print '        cache->target = target;'
+        print '        return target(sp);'
+        print '    }'
+        print '    return native_interp_call(addr, sp);'
+        print '}'
+        print ''
+        print '#define call_cached(n, callee, sp) ({ uint32_t call_addr = (callee); \\'
+        print '        (call_addr == call_cache[n].addr) ? call_cache[n].target(sp) \\'
+        print '            : call_cache_miss(&call_cache[n], call_addr, (sp)); })'
+        print ''
+    print 'void call_caches_reset(void)'
+    print '{'
+    if call_caches:
+        print '    int n;'
+        print '    for (n = 0; n < %d; ++n) call_cache[n].addr = 0xffffffffu;' % \
+            len(call_caches)
+    print '}\n'
+
+    # Strings printed with streamstr from constant addresses are decoded now,
+    # unless they refer to other strings or functions. Translated code prints
+    # them with a single Glk call, as long as the story uses the Glk I/O system
+    # and the decoding table from the header (see native_streamstr_latin1()):
+    decoded_strings = {}
+    for instrs in instructions:
+        for instr in instrs:
+            if instr.mnemonic == 'streamstr' and \
+                    instr.operands[0].is_immediate():
+                offset = instr.operands[0].value() & 0xffffffff
+                chars = decode_string(data, header.ramstart, offset,
+                                      header.decoding_tbl)
+                if chars is not None:
+                    decoded_strings[offset] = chars
+    if decoded_strings:
+        print '/* Decoded strings: */'
+        for offset in sorted(decoded_strings):
+            chars = decoded_strings[offset]
+            if max(chars + [0]) < 256:
+                print 'static const char str_%08x[] = %s;' % \
+                    (offset, string_literal(chars))
+            else:
+                print 'static const uint32_t str_%08x[] = { %s };' % \
+                    (offset, ', '.join([ '0x%x' % c for c in chars ]))
+        print ''
+
+    # Glk functions called directly (see native_glk.c):
+    used_stubs = set([ glk_stub(instr) for instrs in instructions
+                       for instr in instrs if instr.mnemonic == 'glk' ])
+    used_stubs.discard(None)
+    for (name, narg) in sorted(used_stubs):
+        print 'uint32_t native_glk_%s(%s);' % (name,
+            ', '.join(narg*['uint32_t']) or 'void')
+    if used_stubs:
+        print ''
+
+    memoized = [ f for f in functions if f.memoized ]
+    if memoized:
+        print '/* Result caches of memoized functions: */'
+        print '#define MEMO_BITS %d' % memo_bits
+        for f in memoized:
+            print 'static struct Memo%08x' % f.offset()
+            print '{'
+            print '    uint32_t valid, value%s;' % \
+                (f.nlocal and ', key[%d]' % f.nlocal or '')
+            print '} memo_%08x[1 << MEMO_BITS];' % f.offset()
+            print 'static uint32_t memo_%08x_hits, memo_%08x_misses;' % \
+                (f.offset(), f.offset())
+        print ''
+    print 'void memo_report(void)'
+    print '{'
+    for f in memoized:
+        print '    if (memo_%08x_hits + memo_%08x_misses > 0)' % \
+            (f.offset(), f.offset())
+        print '        info("memoized function 0x%%08x: %%u hits, %%u misses", ' \
+              '%du, memo_%08x_hits, memo_%08x_misses);' % \
+              (f.offset(), f.offset(), f.offset())
+    print '}\n'
+
+    if indirect_tailcalls:
+        # Returns the entry point for tail calls to the function at `addr'.
+        # Functions that use a trampoline themselves must be called without
+        # it, or indirect tail call cycles would still grow the native stack.
+        # Functions that weren't translated are run by the interpreter, which
+        # finds the address in sp[1] (see the tailcall code below).
+        print 'static uint32_t (*tail_entry(uint32_t addr))(uint32_t*)'
+        print '{'
+        print '\tswitch (addr)'
+        print '\t{'
+        for f in functions:
+            if f.tail_entry:
+                print '\tcase %du: return &%s;' % (f.offset(), tail_entry_name(f))
+        print '\tdefault:'
+        print '\t\tif (addr < RAMSTART && func(addr) != NULL) return func(addr);'
+        print '\t\treturn &native_interp_tail_entry;'
+        print '\t}'
+        print '}\n'
+
+    # With --profile-instrument, translated code counts function entries and
+    # branches in profile_counts[], with one counter for each site added with
+    # profile_site(). The sites are listed after the functions.
+    profile_sites = []
+    def profile_site(kind, offset):
+        profile_sites.append((kind, offset))
+        return len(profile_sites) - 1
+
     for (func, instrs) in zip(functions, instructions):
 
         print 'static uint32_t %s(uint32_t *sp)' % func_name(func)
         print '{'
 
         if func.type == 0xc0:  # stack args
+            if func.trampolined:
+                print '\treturn trampoline(%s_body(sp));' % func_name(func)
+                print '}'
+                print 'static uint32_t %s_body(uint32_t *sp)' % func_name(func)
+                print '{'
             print '\tuint32_t * const bp = sp - *sp;'
-            for n in range(func.nlocal):
-                print '\tuint32_t loc%d = 0;' % n
+            for n in range(func.nlocal + func.inlined_locals):
+                print '\t%s = 0;' % local_decl(func, n)
             print '\t++sp;'
         elif func.type == 0xc1:  # local args
+            locs = [ 'loc%d'%n for n in range(func.nlocal) ]
             print '\tuint32_t narg = *sp;'
             for n in range(func.nlocal):
                 print '\tuint32_t loc%d = (narg > %d) ? *--sp : 0;' % (n, n)
             print '\treturn %s_args(%s);' % ( func_name(func),
-                ', '.join( func.needs_sp*['sp'] +
-                           ['loc%d'%n for n in range(func.nlocal)] ) )
+                ', '.join(func.needs_sp*['sp'] + locs) )
             print '}'
             print 'static uint32_t %s_args(%s)' % ( func_name(func),
                 ', '.join( func.needs_sp*['uint32_t *sp'] +
-                           ['uint32_t loc%d'%n for n in range(func.nlocal)] ) )
+                           [param_decl(func, n) for n in range(func.nlocal)] ) )
             print '{'
+            if func.memoized:
+                print memo_code(func)
+                print '}'
+                print 'static uint32_t %s_eval(%s)' % ( func_name(func),
+                    ', '.join( func.needs_sp*['uint32_t *sp'] +
+                               [param_decl(func, n) for n in range(func.nlocal)] ) )
+                print '{'
+            if func.trampolined:
+                print '\treturn trampoline(%s_body(%s));' % ( func_name(func),
+                    ', '.join(['sp'] + [ param_name(func, n)
+                                         for n in range(func.nlocal) ]) )
+                print '}'
+            if func.tail_entry:
+                # The tail call entry point drops all arguments from the
+                # stack, so repeated tail calls don't move it:
+                print 'static uint32_t %s_tail(uint32_t *sp)' % func_name(func)
+                print '{'
+                print '\tuint32_t narg = *sp;'
+                for n in range(func.nlocal):
+                    print '\tuint32_t loc%d = (narg > %d) ? sp[%d] : 0;' % \
+                        (n, n, -1 - n)
+                print '\treturn %s_body(%s);' % ( func_name(func),
+                    ', '.join(['sp - narg'] + locs) )
+                print '}'
+            if func.trampolined:
+                print 'static uint32_t %s_body(%s)' % ( func_name(func),
+                    ', '.join( ['uint32_t *sp'] +
+                               [param_decl(func, n) for n in range(func.nlocal)] ) )
+                print '{'
             if func.needs_sp:
                 print '\tuint32_t * const bp = sp;'
+            for n in sorted(func.float_locals):
+                if n < func.nlocal:
+                    print '\tfloat loc%d = long_to_float(loc%d_bits);' % (n, n)
+            for n in range(func.nlocal, func.nlocal + func.inlined_locals):
+                print '\t%s = 0;' % local_decl(func, n)
         else:
             assert 0
 
+        if func.has_catch:
+            # Catch stubs pushed by this function can't be thrown to once it
+            # returns (however it returns):
+            print '\tuint32_t * const catch_bp ' \
+                  '__attribute__((cleanup(native_catch_release))) = bp;'
+
         if func.stack_refs:
             for i in func.stack_refs:
                 if i < 0:
                     print '\tuint32_t %s = sp[%d];' % (sp_name(i), i)
+                elif i in func.float_slots:
+                    print '\tfloat %s;' % sp_name(i)
                 else:
                     print '\tuint32_t %s;' % sp_name(i)
 
+        for key in sorted(func.mem_vars):
+            print '\tuint32_t %s;' % mem_var(key)
+
+        if 'self' in [ tailcall_kind(func, i, func_map) for i in func.tailcalls ]:
+            print 'start:'
+
+        if profile_instrument:
+            print '\t++profile_counts[%d];' % profile_site('f', func.offset())
+
         branch_targets = set([i.branch_target() for i in instrs])
         branch_targets.remove(None)
+        preheader_targets = set([ i.branch_target() for i in instrs
+                                  if i.mem_preheader ])
+
+        # Comparison chains that become switch statements, by first
+        # instruction. Jumps from the switch into a loop go through its
+        # preheader, since they may come from outside the loop.
+        instr_at = dict([ (i.offset(), i) for i in instrs ])
+        switches, continued = {}, set()
+        for instr in instrs:
+            chain = switch_chain(instr, instr_at)
+            if chain is not None and instr not in continued and \
+                    len(chain[1]) >= min_switch_cases:
+                switches[instr] = chain
+                continued.update(chain[3][1:])
+                for (v, c) in chain[1] + [(None, chain[2])]:
+                    if c[0] == 'goto':
+                        if instr_at[c[1]].mem_preload:
+                            preheader_targets.add(c[1])
+                        else:
+                            branch_targets.add(c[1])
+        for instr in continued:
+            switches.pop(instr, None)
 
         for instr in instrs:
             (param, sizes, code) = opcode_map[instr.mnemonic]
             assert len(param) == len(sizes) == len(instr.operands)
+
+            # Profile counters for entries into inlined functions, and for
+            # conditional branches, which count when they are taken in b1:
+            counters, taken_counter = [], None
+            if profile_instrument:
+                if instr.inline_entry is not None:
+                    counters.append(profile_site('f', instr.inline_entry))
+                if 'b' in param and instr.mnemonic not in \
+                        ('jump', 'jumpabs', 'catch') and \
+                        instr not in switches and instr.loop_idiom is None:
+                    counters.append(profile_site('b', instr.origin))
+                    taken_counter = profile_site('t', instr.origin)
+
+            if instr.offset() in preheader_targets:
+                print 'h%08x:' % instr.offset()
+            if instr.mem_preload:
+                # Loop preheader: load loop-invariant memory values
+                for key in instr.mem_preload:
+                    print '\t%s = %s(%s);' % (mem_var(key), mem_getter(key),
+                        mem_addr(key[0], header.ramstart))
             if instr.offset() in branch_targets:
                 print 'a%08x: {' % instr.offset()
             else:
                 print '\t{ /* %08x */' % instr.offset()
 
-            if instr.mnemonic.startswith('callf') and \
-                    instr.operands[0].is_immediate():
+            if instr.mnemonic.startswith('aload') and \
+                    rom_array_value(data, header.ramstart, instr) is not None:
+
+                # Array element in ROM is constant:
+                code = 's1 = %du;' % \
+                    rom_array_value(data, header.ramstart, instr)
+
+            elif instr.mnemonic == 'streamstr' and \
+                    instr.operands[0].is_immediate() and \
+                    instr.operands[0].value() & 0xffffffff in decoded_strings:
+
+                # String decoded at translation time:
+                chars = decoded_strings[instr.operands[0].value() & 0xffffffff]
+                code = 'native_streamstr_%s(l1, str_%08x, %d, sp);' % \
+                    (max(chars + [0]) < 256 and 'latin1' or 'uni',
+                     instr.operands[0].value() & 0xffffffff, len(chars))
+
+            elif instr.mnemonic == 'jumpabs':
+
+                # Absolute jump within this function, or into the interpreter:
+                if instr.branch_target() in [ i.offset() for i in instrs ]:
+                    code = 'goto %s%08x;' % ('ah'[instr.mem_preheader],
+                                             instr.branch_target())
+                else:
+                    code = 'return native_interp_resume(%d, l1, %s);' % \
+                        (func.offset(), interp_state(func))
+
+            elif instr in switches:
+
+                # Chain of comparisons of a local variable with constants:
+                (index, cases, default, members) = switches[instr]
+                code = 'switch (l%d) { ' % (index + 1)
+                for (v, c) in cases:
+                    code += 'case %du: %s ' % (v, continuation_code(c, instr_at))
+                code += 'default: %s }' % continuation_code(default, instr_at)
+
+            elif instr.loop_idiom is not None:
+
+                # Whole loop executed by a native kernel:
+                code = loop_idiom_code(func, instr, data, header.ramstart)
+
+            elif instr.mnemonic.startswith('stk') and \
+                    func.stack_refs is not None:
+
+                # Stack manipulation on stack locations held in variables:
+                code = stack_instr_code(func, instr)
+
+            elif instr.mnemonic.startswith('callf') and \
+                    direct_call_target(instr, func_map) is not None:
 
                 # Shortcut call to known function:
-                f = func_map[instr.operands[0].value()//4]
-                if f.type == 0xc1:
-                    args = [ 'l%d'%(n + 2) if 1 < n + 2 < len(param) else '0'
-                                           for n in range(f.nlocal) ]
-                    code = 's1 = %s_args(%s);' % \
-                        (func_name(f), ', '.join(f.needs_sp*['sp'] + args))
+                f = direct_call_target(instr, func_map)
+                args = [ 'l%d'%n for n in range(2, len(param)) ]
+                code = 's1 = %s;' % direct_call(f, args)
                 f = None  # I wish Python had lexical scoping
 
-            if instr.mnemonic == 'call' or instr.mnemonic == 'tailcall':
+            elif instr.mnemonic == 'tailcall' and \
+                    tailcall_kind(func, instr, func_map) == 'self':
+
+                # Tail call to this function: reassign locals and restart.
+                n = instr.operands[1].value()
+                code, args = stack_call_args(func, instr, n)
+                args = args[:func.nlocal] + ['0']*(func.nlocal - len(args))
+                if args:
+                    code += 'uint32_t %s; ' % ', '.join(
+                        [ 'a%d = %s'%(i, a) for (i, a) in enumerate(args) ])
+                    code += ' '.join([ ('loc%d = long_to_float(a%d);'
+                                        if i in func.float_locals else
+                                        'loc%d = a%d;') % (i,i)
+                                       for i in range(len(args)) ]) + ' '
+                if func.stack_refs is None:
+                    code += 'sp = bp; '
+                code += 'goto start;'
 
+            elif instr.mnemonic == 'tailcall' and \
+                    tailcall_kind(func, instr, func_map) == 'trampoline':
+
+                # Discard this function's stack frame, push the arguments and
+                # let the trampoline call the target (passing the address of
+                # an unknown target above the arguments, for the interpreter):
+                f = tailcall_target(instr, func_map)
+                if f is not None:
+                    target, addr = '&' + tail_entry_name(f), ''
+                else:
+                    target, addr = 'tail_entry(l1)', 'bp[l2 + 1] = l1; '
+                f = None
                 if func.stack_refs:
+                    n = instr.operands[1].value()
+                    _, args = stack_call_args(func, instr, n)
+                    code = ''
+                    for i, a in enumerate(args):
+                        code += 'bp[%d] = %s; ' % (n - 1 - i, a)
+                else:
+                    code = 'memmove(bp, sp - l2, 4*l2); '
+                code += 'bp[l2] = l2; %stail_sp = bp + l2; tail_func = %s; ' \
+                        'return 0;' % (addr, target)
+
+            elif (instr.mnemonic == 'call' or instr.mnemonic == 'tailcall') \
+                    and instr.operands[1].is_immediate() \
+                    and direct_call_target(instr, func_map) is not None:
+
+                # Shortcut call to known function, passing arguments popped
+                # from the stack (first argument on top) as C parameters:
+                if instr.mnemonic == 'call':        res = 's1 ='
+                elif instr.mnemonic == 'tailcall':  res = 'return'
+                else:                               assert False
+
+                f = direct_call_target(instr, func_map)
+                code, args = stack_call_args(func, instr,
+                                             instr.operands[1].value())
+                code += '%s %s;' % (res, direct_call(f, args))
+                f = None
+
+            elif instr.mnemonic == 'call':
 
-                    if instr.mnemonic == 'call':        res = 's1 ='
-                    elif instr.mnemonic == 'tailcall':  res = 'return'
-                    else:                               assert False
+                if func.stack_refs:
 
                     assert instr.operands[1].is_immediate()
                     n = instr.operands[1].value()
@@ -230,54 +1765,109 @@ def main(path = None):
                     code = ''
                     for i in range(h - n, h):
                         code += 'sp[%d] = %s; ' % (i, sp_name(i))
-                    code += 'sp[%d] = %d; %s func(l1)(sp + %d);' % (h,n,res,h)
+                    code += 'sp[%d] = %d; s1 = call_func(l1, sp + %d);' % (h,n,h)
+
+            elif instr.mnemonic == 'glk' and glk_stub(instr) is not None:
+
+                # Direct call to Glk with arguments popped off the stack:
+                (name, narg) = glk_stub(instr)
+                code, args = stack_call_args(func, instr, narg)
+                code += 's1 = native_glk_%s(%s);' % (name, ', '.join(args))
+
+            elif instr.mnemonic == 'glk' and func.stack_refs:
+
+                # Pass arguments on the data stack (the stack analysis only
+                # allows Glk functions that don't use it otherwise):
+                assert instr.operands[1].is_immediate()
+                n = instr.operands[1].value()
+                h = instr.sp
+                code = ''
+                for i in range(h - n, h):
+                    code += 'sp[%d] = %s; ' % (i, sp_name(i))
+                code += 'uint32_t *glk_sp = sp + %d; ' % h
+                code += 's1 = native_glk(l1, l2, &glk_sp);'
+
+            if instr.mnemonic in ('call', 'callf', 'callfi', 'callfii',
+                                  'callfiii') and \
+                    stack_args_call_target(instr, func_map) is not None:
+
+                # Call known stack-argument function without func_map[]:
+                f = stack_args_call_target(instr, func_map)
+                code = code.replace('call_func(l1, ', '%s(' % func_name(f))
+                f = None
+
+            elif instr in call_caches:
+
+                if speculative_target(instr, func_map) is not None:
+
+                    # The profile shows that the call site almost always calls
+                    # the same function, so call it directly if it does:
+                    f = speculative_target(instr, func_map)
+                    if instr.mnemonic == 'call':
+                        n = instr.operands[1].value()
+                        direct, args = stack_call_args(func, instr, n)
+                    else:
+                        direct = ''
+                        args = [ 'l%d'%n for n in range(2, len(param)) ]
+                    code = 'if (l1 == %du) { %ss1 = %s; } else { %s }' % \
+                        (f.offset(), direct, direct_call(f, args), code)
+                    f = None
+
+                if profile_instrument:
+                    code = 'native_profile_call(%d, l1); %s' % \
+                        (instr.origin, code)
+
+                # Call to a computed address through the call site's cache:
+                code = code.replace('call_func(l1, ',
+                                    'call_cached(%d, l1, ' % call_caches[instr])
+
+            if re.match(r'if \(.*\) b1;$', code) and \
+                    expected_branch(instr) is not None:
 
-                    # FIXME: should shortcut call to args() function if
-                    #        operands[0].is_immediate too.
+                # Branch that almost always went the same way in the profile:
+                code = re.sub(r'^if \((.*)\) b1;$',
+                    r'if (__builtin_expect(!!(\1), %d)) b1;' %
+                    expected_branch(instr), code)
 
+            if instr.mnemonic in filter_stream_ops and not func.needs_sp:
+                code = re.sub(r'\bsp\b', 'NULL', code)
 
             ids = range(1, len(param) + 1)
             num_load = num_store = 0
+            avail = set(instr.mem_avail)
             for n,o,p,s in zip(ids, instr.operands, param, sizes):
 
                 if p == 'b':  # label target
                     assert s == 'x'
                     target = instr.branch_target()
                     if target is not None:
-                        print '\t\t#define b1 goto a%08x' % (target)
+                        b1 = 'goto %s%08x' % ('ah'[instr.mem_preheader], target)
                     else:
                         target = instr.return_value()
                         if target is not None:
-                            print '\t\t#define b1 return %d' % (target)
+                            b1 = 'return %d' % (target)
                         else:
-                            print '\t\t#define b1 native_invalidop(%d, "%s")'%\
-                                (instr.offset(), 'indirect jump target')
+                            # Indirect jump: continue in the interpreter
+                            print '\t\tuint32_t b1_offset = %s;' % \
+                                load_expr(func, o, 'L', data, header.ramstart,
+                                          avail)
+                            b1 = 'return native_interp_branch' \
+                                '(%d, %d, b1_offset, %s)' % (func.offset(),
+                                instr.offset() + len(instr), interp_state(func))
+                    if taken_counter is not None:
+                        b1 = 'do { ++profile_counts[%d]; %s; } while (0)' % \
+                            (taken_counter, b1)
+                    print '\t\t#define b1 %s' % b1
 
                 elif p == 'l':  # loaded argument
                     num_load += 1
                     t = int_type(s)
 
-                    if o.is_immediate():
-                        v = str(o.value())
-                        if s in 'LSBf': v += 'u'
-                    elif o.is_mem_ref():
-                        v = '%s(%d)' % (getter(s), o.value()&0xffffffff)
-                    elif o.is_ram_ref():
-                        v = '%s(%d + RAMSTART)' % (getter(s), o.value())
-                    elif o.is_local_ref():
-                        assert o.value()%4 == 0
-                        v = 'loc%d' % (o.value()//4)
-                    elif o.is_stack_ref():
-                        if not func.stack_refs:
-                            v = '(%s)*--sp' % (t,)
-                        else:
-                            v = '(%s)%s' % (t, sp_name(o.value()))
-                    else:
-                        assert 0
-
+                    v = load_expr(func, o, s, data, header.ramstart, avail)
                     if s == 'f':
                         t = 'float'
-                        v = 'long_to_float(%s)' % v
+                        if not float_var(func, o):
+                            v = 'long_to_float(%s)' % v
 
                     print '\t\t%s l%d = %s;' % (t, num_load, v)
 
@@ -295,31 +1885,60 @@ def main(path = None):
                 else:
                     assert 0
 
+            if instr.mnemonic == 'catch':
+                code = code.replace('CATCH_PC', str(instr.offset()))
+
+            for n in counters:
+                print '\t\t++profile_counts[%d];' % n
             if code != '':
                 print '\t\t%s /* %s */' % (code, instr.mnemonic)
             else:
                 print '\t\tnative_invalidop(%d, "%s");'%\
                     (instr.offset(), instr.mnemonic)
 
+            if promoted_globals:
+                if instr.mnemonic in globals_reload_ops and prints_only(instr):
+                    print '\t\tif (memory_streams) globals_reload();'
+                elif instr.mnemonic in globals_reload_ops:
+                    print '\t\tglobals_reload();'
+                elif instr.mnemonic in dynamic_store_ranges:
+                    print '\t\tif (GLOBALS_OVERLAP(%s, %s)) globals_reload();' \
+                        % dynamic_store_ranges[instr.mnemonic]
+
             num_load = num_store = 0
             for n,o,p,s in zip(ids, instr.operands, param, sizes):
                 if p == 'l':
                     pass
                 elif p == 'b':  # branch argument
+                    if instr.mnemonic == 'catch':
+                        # branch only after the catch token has been stored
+                        print '\t\tif (thrown == NULL) b1;'
                     print '\t\t#undef b1'
                 elif p == 's':  # stored argument
                     num_store += 1
                     v = 's%d'%num_store
-                    if s == 'f':
+                    if float_var(func, o):
+                        if s != 'f':
+                            v = 'long_to_float(%s)'%v
+                    elif s == 'f':
                         v = 'float_to_long(%s)'%v
                     if o.is_immediate():
                         assert o.value() == 0
                         print '\t\t(void)%s;'%v
-                    elif o.is_mem_ref():
-                        print '\t\t%s(%d, %s);' % (setter(s), o.value(), v)
-                    elif o.is_ram_ref():
-                        print '\t\t%s(%d + RAMSTART, %s);' % \
-                            (setter(s), o.value(), v)
+                    elif o.is_mem_ref() or o.is_ram_ref():
+                        if o.is_mem_ref():
+                            print '\t\t%s(%d, %s);' % (setter(s), o.value(), v)
+                        else:
+                            print '\t\t%s(%d + RAMSTART, %s);' % \
+                                (setter(s), o.value(), v)
+                        key = memory_key(o, s, header.ramstart)
+                        if key in promoted_globals:
+                            print '\t\t%s = %s;' % (global_var(key), v)
+                        if key in func.mem_vars:
+                            # Remember the stored value, truncated to its size:
+                            print '\t\t%s = %s%s;' % (mem_var(key),
+                                { 1: '(uint8_t)', 2: '(uint16_t)', 4: '' }[key[1]],
+                                v)
                     elif o.is_local_ref():
                         print '\t\tloc%d = %s;' % (o.value()//4, v)
                     elif o.is_stack_ref():
@@ -337,4 +1956,22 @@ def main(path = None):
         print '\treturn 0;'
         print '}\n'
 
-if __name__ == '__main__': main(*sys.argv[1:])
+    print 'uint32_t profile_counts[%d];' % max(len(profile_sites), 1)
+    print 'const struct ProfileSite profile_sites[] = {'
+    for (kind, offset) in profile_sites:
+        print "    { '%s', 0x%08xu }," % (kind, offset)
+    print '    { 0, 0 } };'
+
+if __name__ == '__main__':
+    opts, args = getopt.getopt(sys.argv[1:], '',
+        ['promote-globals', 'inline-budget=', 'keep-unused-functions',
+         'memoize', 'frozen-ram=', 'profile-instrument', 'profile='])
+    opts = dict(opts)
+    main(*args, promote_globals = '--promote-globals' in opts,
+         inline_budget = int(opts.get('--inline-budget',
+                                      default_inline_budget)),
+         keep_unused = '--keep-unused-functions' in opts,
+         memoize = '--memoize' in opts,
+         frozen_ram_path = opts.get('--frozen-ram'),
+         profile_instrument = '--profile-instrument' in opts,
+         profile_path = opts.get('--profile'))
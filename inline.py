@@ -0,0 +1,268 @@
+# Inlines small functions into their callers, at the level of Glulx
+# instructions, before any other analysis takes place.
+#
+# The C compiler sees translated functions only as entries of func_map[] and
+# inlines them inconsistently, and it can't specialize a function for
+# constant arguments unless its body is in the caller. Inlining Glulx code
+# instead lets the stack, memory and type analyses of the translator see the
+# callee's instructions in the context of the call.
+#
+# A call to a small local-argument function is replaced by:
+#   - copies of the arguments to fresh locals of the caller (popping the
+#     arguments of `call' off the stack), and zeroing of the other locals of
+#     the callee;
+#   - a copy of the callee's instructions, with its locals renamed to the
+#     fresh locals, and each return turned into a copy of the result to the
+#     call's store operand followed by a jump to the instruction after the
+#     call (returns through branch operands jump to a stub that does this).
+#
+# Only callees whose data stack is balanced at every return, and that never
+# pop values pushed by the caller, can be inlined, since their stack frame
+# disappears. Callers that may continue in the interpreter (or catch
+# exceptions) are left alone, since the interpreter expects their original
+# locals. The first inlined instruction takes over the offset of the call;
+# the others get new offsets beyond any code in the story file, so that they
+# can be labelled in the translated code.
+#
+# Every instruction has the attributes:
+#   instr.origin        offset of the instruction of the story file that it
+#                       was copied from (its own offset, if it wasn't)
+#   instr.inline_entry  for the first instruction of an inlined call, the
+#                       offset of the callee, otherwise None
+# so that profiles (see glulx-to-c.py) can refer to the story's own code,
+# whichever functions were inlined.
+
+from Ops import Instr, Operand
+from analyze import analyze_control_flow, analyze_stack_pointer
+
+call_ops = ('call', 'callf', 'callfi', 'callfii', 'callfiii')
+
+# Opcodes of instructions created by the inliner:
+op_nop, op_jump, op_copy = 0x00, 0x20, 0x40
+
+def local_operand(offset):
+    '''Returns an operand that refers to the local at the given byte offset.'''
+    if offset < 0x100:
+        return Operand(0x9, offset)
+    if offset < 0x10000:
+        return Operand(0xa, offset)
+    return Operand(0xb, offset)
+
+def copy_operand(o, locals_base):
+    '''Returns a copy of operand `o', with references to locals moved up by
+       `locals_base' bytes.'''
+    if o.is_local_ref():
+        return local_operand(o.value() + locals_base)
+    return Operand(o.mode(), o.value())
+
+def known_branches(instrs):
+    '''Returns whether all branches in `instrs' stay within the function.'''
+    offsets = set([ instr.offset() for instr in instrs ])
+    for instr in instrs:
+        if instr.is_branch() and instr.return_value() is None and \
+                instr.branch_target() not in offsets:
+            return False
+    return True
+
+def inlinable(func, instrs, budget):
+    '''Returns the reachable instructions of `func' if it can be inlined, or
+       None otherwise.'''
+    if func.type != 0xc1 or len(instrs) > budget or \
+            [ size for (size, count) in func.locals if size != 4 ]:
+        return None
+    for instr in instrs:
+        if instr.mnemonic in ('catch', 'tailcall', 'jumpabs') or \
+                instr.mnemonic.startswith('stk'):
+            return None
+    if not instrs or not known_branches(instrs):
+        return None
+
+    edges = analyze_control_flow(instrs)
+    if edges is None:
+        return None
+    height = analyze_stack_pointer(instrs, edges)
+    if height is None:
+        return None
+    reachable = [ instr for (instr, h) in zip(instrs, height) if h is not None ]
+    for instr in reachable:
+        # Branches that return (and jumps to ?rtrue/?rfalse) become returns
+        # too when inlined, so they must leave the stack balanced as well:
+        returns = instr.mnemonic == 'ret' or \
+            (instr.is_branch() and instr.return_value() is not None)
+        if instr.sp_low < 0 or (returns and instr.sp_low != 0):
+            return None
+    return reachable
+
+def inline_call(call, callee, body, locals_base):
+    '''Returns a list of pairs (instruction, branch target) that replace call
+       instruction `call' to function `callee' with the given instructions.
+       Targets are instructions of the list, 'next' for the instruction after
+       the call, or None. Offsets are assigned later by splice_calls().'''
+    def new_instr(opcode, operands):
+        instr = Instr(opcode, operands)
+        instr.origin, instr.inline_entry = call.origin, None
+        return instr
+
+    dest = call.operands[-1]
+    if call.mnemonic == 'call':
+        args = [ Operand(0x8, 0) ] * call.operands[1].value()
+    else:
+        args = call.operands[1:-1]
+
+    res = []
+    for (n, o) in enumerate(args):
+        if n < callee.nlocal:
+            s = local_operand(locals_base + 4*n)
+        elif o.is_stack_ref():
+            s = Operand(0x0, 0)  # surplus argument is popped and discarded
+        else:
+            continue
+        res.append((new_instr(op_copy, [ copy_operand(o, 0), s ]), None))
+    for n in range(len(args), callee.nlocal):
+        res.append((new_instr(op_copy, [ Operand(0x0, 0),
+                                         local_operand(locals_base + 4*n) ]),
+                    None))
+    if not res:
+        res.append((new_instr(op_nop, []), None))  # takes the call's offset
+    res[0][0].inline_entry = callee.offset()
+
+    # Copy the callee's instructions. Branch targets are resolved below;
+    # returns through branch operands go to a stub per return value. Results
+    # of calls that are discarded need not be copied, unless they are popped
+    # off the stack.
+    index, stubs = {}, {}
+    def ret(o):
+        if not (dest.mode() == 0 and not o.is_stack_ref()):
+            res.append((new_instr(op_copy, [ o, copy_operand(dest, 0) ]),
+                        None))
+        res.append((new_instr(op_jump, [ Operand(0x3, 0) ]), 'next'))
+    for instr in body:
+        index[instr.offset()] = len(res)
+        if instr.mnemonic == 'ret':
+            ret(copy_operand(instr.operands[0], locals_base))
+        else:
+            operands = [ copy_operand(o, locals_base) for o in instr.operands ]
+            target = None
+            if instr.is_branch():
+                target = instr.return_value()
+                if target is not None:
+                    stubs[target] = None
+                    target = ('ret', target)
+                else:
+                    target = instr.branch_target()
+                operands[instr.parameters.find('b')] = Operand(0x3, 0)
+            copy = Instr(instr.opcode, operands)
+            copy.origin, copy.inline_entry = instr.origin, instr.inline_entry
+            res.append((copy, target))
+    for value in sorted(stubs):
+        stubs[value] = len(res)
+        ret(Operand(0x1, value))
+
+    # Resolve branch targets to instructions of the list:
+    instrs = [ instr for (instr, target) in res ]
+    for (n, (instr, target)) in enumerate(res):
+        if isinstance(target, tuple):
+            res[n] = (instr, instrs[stubs[target[1]]])
+        elif target is not None and target != 'next':
+            res[n] = (instr, instrs[index[target]])
+
+    # A jump to the next instruction at the end is redundant:
+    if res[-1][1] == 'next':
+        last = res.pop()[0]
+        res = [ (instr, 'next' if target is last else target)
+                for (instr, target) in res ]
+    return res
+
+def splice_calls(instrs, calls, new_offset):
+    '''Replaces call instructions in `instrs' by the instruction lists in
+       dictionary `calls', and sets the offsets and branch operands of the
+       new instructions. New offsets are allocated from `new_offset', and the
+       next free offset is returned.'''
+    res, targets = [], []
+    for (i, instr) in enumerate(instrs):
+        if instr not in calls:
+            res.append(instr)
+            continue
+        for (n, (new, target)) in enumerate(calls[instr]):
+            if n == 0:
+                new.set_offset(instr.offset())
+            else:
+                new.set_offset(new_offset)
+                new_offset += len(new)
+            if target == 'next':
+                target = instrs[i + 1]
+            if target is not None:
+                targets.append((new, target))
+            res.append(new)
+    for (instr, target) in targets:
+        i = instr.parameters.find('b')
+        instr.operands[i] = Operand(0x3,
+            target.offset() - instr.offset() - len(instr) + 2)
+        instr.update()
+        assert instr.branch_target() == target.offset()
+    instrs[:] = res
+    return new_offset
+
+def call_target(instr, func_map):
+    '''Returns the function that `instr' calls if it is a call to a known
+       function that may be inlined, or None otherwise.'''
+    if instr.mnemonic not in call_ops or not instr.operands[0].is_immediate():
+        return None
+    if instr.mnemonic == 'call' and not instr.operands[1].is_immediate():
+        return None
+    target = instr.operands[0].value()
+    if not (0 <= target < len(func_map)*4):
+        return None
+    f = func_map[target//4]
+    if f is None or f.accelerated:
+        return None
+    return f
+
+def callees_first(functions, instructions, func_map):
+    '''Returns pairs of functions and their instructions, ordered so that
+       functions come after the functions they call (except on cycles).'''
+    instrs_of = dict(zip(functions, instructions))
+    order, seen = [], set()
+    for f in functions:
+        todo = [ (f, False) ]
+        while todo:
+            (g, done) = todo.pop()
+            if done:
+                order.append((g, instrs_of[g]))
+            elif g not in seen:
+                seen.add(g)
+                todo.append((g, True))
+                for instr in reversed(instrs_of[g]):
+                    h = call_target(instr, func_map)
+                    if h is not None and h not in seen:
+                        todo.append((h, False))
+    return order
+
+def inline_functions(functions, instructions, func_map, budget, new_offset,
+                     budgets = {}):
+    '''Inlines calls to functions of at most `budget' instructions (see
+       above), or the number given for them in dictionary `budgets',
+       allocating offsets for new instructions from `new_offset'.
+       Callees are processed before their callers, so that calls inlined into
+       a callee are inlined into its callers too, as far as the budget allows.
+       Functions get an attribute `inlined_locals' with the number of locals
+       added to hold the locals of inlined functions.'''
+    for f in functions:
+        f.inlined_locals = 0
+        f.inline_body = None
+
+    for (f, instrs) in callees_first(functions, instructions, func_map):
+        if 'catch' not in [ i.mnemonic for i in instrs ] and \
+                known_branches(instrs):
+            calls = {}
+            for (i, instr) in enumerate(instrs):
+                g = call_target(instr, func_map)
+                if g is None or g is f or g.inline_body is None or \
+                        i + 1 == len(instrs):
+                    continue
+                base = 4*(f.nlocal + f.inlined_locals)
+                calls[instr] = inline_call(instr, g, g.inline_body, base)
+                f.inlined_locals += g.nlocal + g.inlined_locals
+            if calls:
+                new_offset = splice_calls(instrs, calls, new_offset)
+        f.inline_body = inlinable(f, instrs, budgets.get(f, budget))
@@ -1,2 +1,3 @@
 #include "native.h"
-uint8_t mem[MAX_MEM_SIZE] = { 0 };
+/* Page-aligned, so that pages of RAM can be protected (see native_frozen.c): */
+uint8_t mem[MAX_MEM_SIZE] __attribute__((aligned(4096))) = { 0 };
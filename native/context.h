@@ -28,8 +28,10 @@ void *context_start(void *stack, size_t size, void *(*main)(void*), void *arg);
 void *context_restart(void *stack, size_t size, struct Context *ptr, void *arg);
 
 /* Saves the execution context in *ptr and returns NULL if returning directly,
-   or when restoring the context, the argument passed to context_restore(). */
-void *context_save(struct Context *ptr);
+   or when restoring the context, the argument passed to context_restore().
+   Like setjmp(), this returns twice; the attribute keeps the compiler from
+   caching local variables in registers across the call. */
+void *context_save(struct Context *ptr) __attribute__((returns_twice));
 
 /* Restores the execution context pointed to by `ptr'. Control does not pass
    back to the caller of context_restore(). */
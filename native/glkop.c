@@ -820,6 +820,34 @@ strid_t find_stream_by_id(glui32 objid)
   return classes_get(1, objid);
 }
 
+/* find_object_by_id(), find_id_for_object():
+   These are used by the Glk stubs in native_glk.c, which call Glk functions
+   directly instead of through the dispatch layer.
+*/
+void *find_object_by_id(int classid, glui32 objid)
+{
+  void *obj;
+
+  if (!objid)
+    return NULL;
+
+  obj = classes_get(classid, objid);
+  if (!obj)
+    fatal_error("Reference to nonexistent Glk object.");
+  return obj;
+}
+
+glui32 find_id_for_object(int classid, void *obj)
+{
+  gidispatch_rock_t objrock;
+
+  if (!obj)
+    return 0;
+
+  objrock = gidispatch_get_objrock(obj, classid);
+  return ((classref_t *)objrock.ptr)->id;
+}
+
 /* Build a hash table to hold a set of Glk objects. */
 static classtable_t *new_classtable(glui32 firstid)
 {
@@ -5,5 +5,7 @@
 
 int init_dispatch(void);
 glui32 perform_glk(glui32 funcnum, glui32 numargs, glui32 *arglist);
+void *find_object_by_id(int classid, glui32 objid);
+glui32 find_id_for_object(int classid, void *obj);
 
 #endif /* ndef GLKOP_H */
\ No newline at end of file
@@ -20,6 +20,7 @@ struct Undo {
 };
 
 struct Context *start_ctx = NULL;  /* also used in native_state.c */
+struct CatchStub *catch_top = NULL;  /* also used in native_state.c */
 static struct Undo *undo = NULL;
 static char *restore_data = NULL;
 static size_t restore_size = 0;
@@ -37,19 +38,41 @@ char *decompress_state( char *prev, size_t prev_size,
 /* Defined in native_protect */
 void push_protected();
 void pop_protected();
+void native_heap_reset(void);
 
-void native_accelfunc(uint32_t l1, uint32_t l2)
+/* Defined in native_frozen */
+void frozen_ram_protect(void);
+void frozen_ram_unprotect(void);
+void frozen_ram_report(void);
+
+/* Defined in native_profile */
+void native_profile_report(void);
+
+/* Catch stubs that can be thrown to form a chain from catch_top, innermost
+   first.  Stubs are dropped from the chain when they are thrown to, when the
+   function that pushed them returns, or when their place on the data stack
+   is reused for another stub, so that stale catch tokens are rejected. */
+static void catch_pop(uint32_t *top)
+{
+    while (catch_top != NULL && (uint32_t*)catch_top >= top)
+        catch_top = catch_top->prev;
+}
+
+uint32_t native_catch(struct CatchStub *stub, uint32_t pc)
 {
-    /* not implemented */
-    (void)l1;
-    (void)l2;
+    catch_pop((uint32_t*)stub);
+    stub->magic = CATCH_MAGIC;
+    stub->pc    = pc;
+    stub->prev  = catch_top;
+    catch_top   = stub;
+    return 4*((uint32_t*)stub - data_stack + CATCH_STUB_WORDS);
 }
 
-void native_accelparam(uint32_t l1, uint32_t l2)
+/* Drops the catch stubs of a function with stack frame `*bp' that returns
+   (called through the cleanup attribute in translated code): */
+void native_catch_release(uint32_t *const *bp)
 {
-    /* not implemented */
-    (void)l1;
-    (void)l2;
+    catch_pop(*bp);
 }
 
 volatile uint32_t debug_arg;
@@ -64,8 +87,7 @@ void native_debugtrap(uint32_t argument)
 uint32_t native_gestalt(uint32_t selector, uint32_t argument)
 {
     /* Note that most of these check for support of opcodes, not necessarily
-       functionality! e.g. we support the accelfunc and accelparam opcodes, but
-       we don't accelerate any functions. */
+       functionality! */
 
     switch (selector)
     {
@@ -78,7 +100,7 @@ uint32_t native_gestalt(uint32_t selector, uint32_t argument)
                (NATIVE_VERSION_REVIS<< 0);
 
     case 2:  /* ResizeMem */
-        return 0;  /* cannot resize memory */
+        return 1;  /* setmemsize supported */
 
     case 3:  /* Undo */
         return 1;
@@ -87,9 +109,10 @@ uint32_t native_gestalt(uint32_t selector, uint32_t argument)
         switch (argument)
         {
         case IOSYS_NULL:
-        case IOSYS_FILTER:
         case IOSYS_GLK:
             return 1;
+        case IOSYS_FILTER:
+            return init_filter_iosys;
         default:
             return 0;
         }
@@ -101,16 +124,16 @@ uint32_t native_gestalt(uint32_t selector, uint32_t argument)
         return 1; /* mzero/mcopy supported */
 
     case 7: /* MAlloc */
-        return 0;  /* malloc/mfree opcodes supported  */
+        return 1;  /* malloc/mfree opcodes supported  */
 
     case 8: /* MAllocHeap */
-        return 0;  /* offset of heap, or 0 if not used */
+        return native_heapstart();  /* offset of heap, or 0 if not used */
 
     case 9: /* Accelleration */
         return 1;  /* accelfunc/accelparam opcodes supported */
 
     case 10: /* AccelFunc */
-        return 0;  /* unknown function */
+        return native_accel_supported(argument);
 
     case 11: /* Float */
         return 1;  /* floating point opcodes supported */
@@ -121,26 +144,13 @@ uint32_t native_gestalt(uint32_t selector, uint32_t argument)
 }
 
 #undef native_getmemsize
-uint32_t native_getmemsize() { return init_endmem; }
+uint32_t native_getmemsize() { return mem_size; }
 
 void native_invalidop(uint32_t offset, const char *descr)
 {
     error("unsupported operation at offset 0x%08x: %s", offset, descr);
 }
 
-uint32_t native_malloc(uint32_t size)
-{
-    /* intentionally not implemented */
-    (void)size;
-    return 0;
-}
-
-void native_mfree(uint32_t offset)
-{
-    /* intentionally not implemented */
-    (void)offset;
-}
-
 void native_quit()
 {
     /* Signal quit */
@@ -152,8 +162,15 @@ void native_reset()
     extern const uint8_t *glulx_data;
     extern size_t         glulx_size;
 
+    frozen_ram_unprotect();
     push_protected();
 
+    /* Reset memory size and deactivate the heap: */
+    native_heap_reset();
+
+    /* The data stack is discarded, including catch stubs: */
+    catch_top = NULL;
+
     /* Copy initialized data section: */
     if (glulx_size >= init_extstart)
     {
@@ -171,7 +188,10 @@ void native_reset()
     if (get_long(32) != init_checksum)
         fatal("checksum mismatch between story data and story code");
 
+    globals_reload();
+
     pop_protected();
+    frozen_ram_protect();
 
     /* Reset string decoding table */
     native_setstringtbl(init_decoding_tbl);
@@ -254,10 +274,12 @@ static int pop_undo_state()
     struct Undo *u = undo;
 
     assert(u != NULL);
+    frozen_ram_unprotect();
     push_protected();
     ctx = native_deserialize(u->data, u->size);
     assert(ctx != NULL);
     pop_protected();
+    frozen_ram_protect();
     undo = u->previous;
     if (undo != NULL)
     {
@@ -279,10 +301,12 @@ static int restore_state()
 {
     struct Context *ctx;
 
+    frozen_ram_unprotect();
     push_protected();
     ctx = native_deserialize(restore_data, restore_size);
     assert(ctx != NULL);
     pop_protected();
+    frozen_ram_protect();
     free(restore_data);
     restore_data = NULL;
     restore_size = 0;
@@ -299,6 +323,9 @@ void native_start()
         case 0:
         case SIGNAL_QUIT:
             info("quit");
+            memo_report();
+            frozen_ram_report();
+            native_profile_report();
             return;
 
         case SIGNAL_RESTART:
@@ -325,13 +352,6 @@ void native_start()
     }
 }
 
-uint32_t native_setmemsize(uint32_t new_size)
-{
-    /* intentionally not implemented */
-    (void)new_size;
-    return 1; /* indicate failure */
-}
-
 void native_stkroll(uint32_t size, int32_t steps, uint32_t *sp)
 {
     uint32_t *tmp, i, j;
@@ -357,6 +377,30 @@ void native_stkroll(uint32_t size, int32_t steps, uint32_t *sp)
     }
 }
 
+void native_throw(uint32_t value, uint32_t token)
+{
+    struct CatchStub *stub, *live;
+
+    if (token%4 != 0 || token/4 < CATCH_STUB_WORDS ||
+        token > DATA_STACK_SIZE)
+    {
+        fatal("invalid catch token (%u) thrown", token);
+    }
+    stub = (struct CatchStub*)(data_stack + token/4 - CATCH_STUB_WORDS);
+    for (live = catch_top; live != NULL && live != stub; live = live->prev) { }
+    if (live == NULL || stub->magic != CATCH_MAGIC)
+    {
+        fatal("invalid catch token (%u) thrown", token);
+    }
+
+    /* Catch stubs can only be thrown to once, since they are popped (along
+       with the stubs of the functions that are unwound): */
+    stub->magic = 0;
+    catch_top = stub->prev;
+    stub->value = value;
+    context_restore(&stub->ctx, stub);
+}
+
 uint32_t native_verify()
 {
     /* no need to do anything; game was verified on start */
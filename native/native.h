@@ -21,13 +21,31 @@ enum IoSys {
     IOSYS_FILTER = 1,
     IOSYS_GLK    = 2 };
 
+/* Call stub pushed on the data stack by the catch instruction. The catch
+   token is the byte offset in data_stack[] of the end of the stub. */
+struct CatchStub
+{
+    struct Context ctx;     /* execution context of the catch instruction */
+    uint32_t magic;         /* CATCH_MAGIC while the stub is valid */
+    uint32_t pc;            /* offset of the catch instruction */
+    uint32_t value;         /* thrown value */
+    struct CatchStub *prev; /* next enclosing stub that can be thrown to */
+};
+
+#define CATCH_MAGIC         0x43617463u  /* "Catc" */
+#define CATCH_STUB_WORDS    ((sizeof(struct CatchStub) + 3)/4)
+
 /* VM state. Initialized in bss_*.c */
 extern uint8_t          mem[];
 extern uint32_t         data_stack[];
 extern char             call_stack[];
+extern uint32_t         mem_size;       /* see native_heap.c */
+extern uint32_t         memory_streams; /* see native_io.c */
 
-void native_accelfunc(uint32_t l1, uint32_t l2);
-void native_accelparam(uint32_t l1, uint32_t l2);
+void native_accelfunc(uint32_t index, uint32_t addr);
+void native_accelparam(uint32_t index, uint32_t value);
+uint32_t native_accel_supported(uint32_t index);
+uint32_t (*native_accel_original(uint32_t addr))(uint32_t*);
 uint32_t native_linearsearch(
     uint32_t key, uint32_t key_size, uint32_t start, uint32_t struct_size,
     uint32_t num_structs, uint32_t key_offset, uint32_t options );
@@ -37,12 +55,31 @@ uint32_t native_binarysearch(
 uint32_t native_linkedsearch(
     uint32_t key, uint32_t key_size, uint32_t start, uint32_t key_offset,
     uint32_t next_offset, uint32_t options );
+void native_loop_copy(uint32_t dst, uint32_t src, uint32_t count,
+                      uint32_t size);
+void native_loop_fill(uint32_t dst, uint32_t value, uint32_t count,
+                      uint32_t size);
+uint32_t native_loop_find(uint32_t base, uint32_t value, uint32_t count,
+                          uint32_t size, uint32_t equal);
+uint32_t native_loop_compare(uint32_t a, uint32_t b, uint32_t count,
+                             uint32_t size);
+uint32_t native_catch(struct CatchStub *stub, uint32_t pc);
+void native_catch_release(uint32_t *const *bp);
 void native_debugtrap(uint32_t argument);
 uint32_t native_gestalt(uint32_t selector, uint32_t argument);
 void native_getiosys(uint32_t *mode, uint32_t *rock);
-#define native_getmemsize() (init_endmem)
+#define native_getmemsize() (mem_size)
 uint32_t native_getstringtbl();
+uint32_t native_heapstart();
 uint32_t native_glk(uint32_t selector, uint32_t narg, uint32_t **sp);
+uint32_t native_interp_call(uint32_t addr, uint32_t *sp);
+uint32_t native_interp_resume(uint32_t addr, uint32_t pc,
+                              const uint32_t *locals, uint32_t nlocal,
+                              uint32_t *bp, uint32_t *sp);
+uint32_t native_interp_branch(uint32_t addr, uint32_t next_pc, uint32_t offset,
+                              const uint32_t *locals, uint32_t nlocal,
+                              uint32_t *bp, uint32_t *sp);
+uint32_t native_interp_tail_entry(uint32_t *sp);
 void native_invalidop(uint32_t offset, const char *descr);
 uint32_t native_malloc(uint32_t size);
 void native_mfree(uint32_t offset);
@@ -61,10 +98,15 @@ void native_setiosys(uint32_t mode, uint32_t rock);
 void native_setrandom(uint32_t l1);
 void native_setstringtbl(uint32_t offset);
 void native_stkroll(uint32_t size, int32_t steps, uint32_t *sp);
+void native_throw(uint32_t value, uint32_t token);
 void native_streamchar(uint8_t ch, uint32_t *sp);
 void native_streamunichar(uint32_t ch, uint32_t *sp);
 void native_streamnum(int32_t n, uint32_t *sp);
 void native_streamstr(uint32_t offset, uint32_t *sp);
+void native_streamstr_latin1(uint32_t offset, const char *s, uint32_t len,
+                             uint32_t *sp);
+void native_streamstr_uni(uint32_t offset, const uint32_t *s, uint32_t len,
+                          uint32_t *sp);
 uint32_t *native_ustring_dup(uint32_t offset);
 uint32_t native_verify();
 int32_t native_ftonumz(float f);
@@ -0,0 +1,368 @@
+#include "native.h"
+#include "storycode.h"
+#include "messages.h"
+#include <stdbool.h>
+
+/* Native implementations of the Inform veneer routines that can be registered
+   with the accelfunc opcode.  When a function is accelerated, its entry in
+   func_table[] is replaced by one of the functions below, which take their
+   arguments from the data stack just like translated functions do.
+
+   Functions 1-7 assume the object layout of Inform 6.31 (with 7 attribute
+   bytes); functions 8-13 are equivalent but use the number of attribute bytes
+   set with accelparam 7. */
+
+#define NUM_ACCEL_FUNCS     13
+#define MAX_ACCELERATED     64
+
+/* Parameters set with accelparam: */
+static uint32_t classes_table       = 0;    /* class object array */
+static uint32_t indiv_prop_start    = 0;    /* first individual property */
+static uint32_t class_metaclass     = 0;    /* "Class" class object */
+static uint32_t object_metaclass    = 0;    /* "Object" class object */
+static uint32_t routine_metaclass   = 0;    /* "Routine" class object */
+static uint32_t string_metaclass    = 0;    /* "String" class object */
+static uint32_t self                = 0;    /* address of global "self" */
+static uint32_t num_attr_bytes      = 0;    /* number of attributes / 8 */
+static uint32_t cpv__start          = 0;    /* common property defaults */
+
+/* Functions currently accelerated, with their original func_table[] entries: */
+static struct Accelerated
+{
+    uint32_t addr;
+    uint32_t (*original)(uint32_t*);
+} accelerated[MAX_ACCELERATED];
+static int num_accelerated = 0;
+
+/* Returns argument `n' of the call whose argument count is stored at `sp'. */
+#define ARG(sp, n) (*(sp) > (n) ? (sp)[-1 - (n)] : 0)
+
+/* Prints a programming error to the current output stream, like the veneer
+   routines would. */
+static void accel_error(const char *msg, uint32_t *sp)
+{
+    native_streamchar('\n', sp);
+    while (*msg) native_streamchar(*msg++, sp);
+    native_streamchar('\n', sp);
+    globals_reload();  /* in case output went to a memory stream */
+}
+
+static uint32_t z__region(uint32_t addr)
+{
+    uint32_t tb;
+
+    if (addr < 36 || addr >= native_getmemsize()) return 0;
+    tb = get_byte(addr);
+    if (tb >= 0xe0) return 3;
+    if (tb >= 0xc0) return 2;
+    if (tb >= 0x70 && tb <= 0x7f && addr >= init_ramstart) return 1;
+    return 0;
+}
+
+static bool obj_in_class(uint32_t obj, uint32_t attr_bytes)
+{
+    /* Checks whether obj is contained in Class (not whether it is a member) */
+    return get_long(obj + 13 + attr_bytes) == class_metaclass;
+}
+
+static uint32_t cp__tab(uint32_t obj, uint32_t id, uint32_t attr_bytes,
+                        uint32_t *sp)
+{
+    uint32_t otab;
+
+    if (z__region(obj) != 1)
+    {
+        accel_error("[** Programming error: tried to find the \".\" of "
+                    "(something) **]", sp);
+        return 0;
+    }
+    otab = get_long(obj + 1 + attr_bytes + 8);
+    if (otab == 0) return 0;
+    return native_binarysearch(id, 2, otab + 4, 10, get_long(otab), 0, 0);
+}
+
+static uint32_t oc__cl(uint32_t obj, uint32_t cla, uint32_t attr_bytes,
+                       uint32_t *sp);
+
+static uint32_t get_prop(uint32_t obj, uint32_t id, uint32_t attr_bytes,
+                         uint32_t *sp)
+{
+    uint32_t cla = 0, prop;
+
+    if (id & 0xffff0000)
+    {
+        cla = get_long(classes_table + 4*(id & 0xffff));
+        if (oc__cl(obj, cla, attr_bytes, sp) == 0) return 0;
+        obj = cla;
+        id >>= 16;
+    }
+
+    prop = cp__tab(obj, id, attr_bytes, sp);
+    if (prop == 0) return 0;
+
+    if (obj_in_class(obj, attr_bytes) && cla == 0)
+    {
+        if (id < indiv_prop_start || id >= indiv_prop_start + 8) return 0;
+    }
+
+    if (get_long(self) != obj)
+    {
+        if (get_byte(prop + 9) & 1) return 0;
+    }
+
+    return prop;
+}
+
+static uint32_t ra__pr(uint32_t obj, uint32_t id, uint32_t attr_bytes,
+                       uint32_t *sp)
+{
+    uint32_t prop = get_prop(obj, id, attr_bytes, sp);
+    return prop == 0 ? 0 : get_long(prop + 4);
+}
+
+static uint32_t rl__pr(uint32_t obj, uint32_t id, uint32_t attr_bytes,
+                       uint32_t *sp)
+{
+    uint32_t prop = get_prop(obj, id, attr_bytes, sp);
+    return prop == 0 ? 0 : 4*get_shrt(prop + 2);
+}
+
+static bool is_metaclass(uint32_t obj)
+{
+    return obj == class_metaclass || obj == object_metaclass ||
+           obj == routine_metaclass || obj == string_metaclass;
+}
+
+static uint32_t oc__cl(uint32_t obj, uint32_t cla, uint32_t attr_bytes,
+                       uint32_t *sp)
+{
+    uint32_t prop, inlist, inlistlen, n;
+
+    switch (z__region(obj))
+    {
+    case 3: return cla == string_metaclass;
+    case 2: return cla == routine_metaclass;
+    case 1: break;
+    default: return 0;
+    }
+
+    if (cla == class_metaclass)
+        return obj_in_class(obj, attr_bytes) || is_metaclass(obj);
+
+    if (cla == object_metaclass)
+        return !obj_in_class(obj, attr_bytes) && !is_metaclass(obj);
+
+    if (cla == string_metaclass || cla == routine_metaclass)
+        return 0;
+
+    if (!obj_in_class(cla, attr_bytes))
+    {
+        accel_error("[** Programming error: tried to apply 'ofclass' with "
+                    "non-class **]", sp);
+        return 0;
+    }
+
+    prop = get_prop(obj, 2, attr_bytes, sp);
+    if (prop == 0) return 0;
+
+    inlist = get_long(prop + 4);
+    if (inlist == 0) return 0;
+
+    inlistlen = get_shrt(prop + 2);
+    for (n = 0; n < inlistlen; ++n)
+    {
+        if (get_long(inlist + 4*n) == cla) return 1;
+    }
+    return 0;
+}
+
+static uint32_t rv__pr(uint32_t obj, uint32_t id, uint32_t attr_bytes,
+                       uint32_t *sp)
+{
+    uint32_t addr = ra__pr(obj, id, attr_bytes, sp);
+    if (addr == 0)
+    {
+        if (id > 0 && id < indiv_prop_start)
+            return get_long(cpv__start + 4*id);
+        accel_error("[** Programming error: tried to read (something) **]", sp);
+        return 0;
+    }
+    return get_long(addr);
+}
+
+static uint32_t op__pr(uint32_t obj, uint32_t id, uint32_t attr_bytes,
+                       uint32_t *sp)
+{
+    switch (z__region(obj))
+    {
+    case 3:
+        /* print is indiv_prop_start + 6, print_to_array is + 7 */
+        return id == indiv_prop_start + 6 || id == indiv_prop_start + 7;
+    case 2:
+        /* call is indiv_prop_start + 5 */
+        return id == indiv_prop_start + 5;
+    case 1:
+        break;
+    default:
+        return 0;
+    }
+
+    if (id >= indiv_prop_start && id < indiv_prop_start + 8 &&
+        obj_in_class(obj, attr_bytes)) return 1;
+
+    return ra__pr(obj, id, attr_bytes, sp) != 0;
+}
+
+/* Entry points with the calling convention of func_table[].  The area above
+   `sp' is free, so sp + 1 is passed down for printing error messages. */
+
+static uint32_t accel_1(uint32_t *sp)
+{
+    return z__region(ARG(sp, 0));
+}
+
+static uint32_t accel_2(uint32_t *sp)
+{
+    return cp__tab(ARG(sp, 0), ARG(sp, 1), 7, sp + 1);
+}
+
+static uint32_t accel_3(uint32_t *sp)
+{
+    return ra__pr(ARG(sp, 0), ARG(sp, 1), 7, sp + 1);
+}
+
+static uint32_t accel_4(uint32_t *sp)
+{
+    return rl__pr(ARG(sp, 0), ARG(sp, 1), 7, sp + 1);
+}
+
+static uint32_t accel_5(uint32_t *sp)
+{
+    return oc__cl(ARG(sp, 0), ARG(sp, 1), 7, sp + 1);
+}
+
+static uint32_t accel_6(uint32_t *sp)
+{
+    return rv__pr(ARG(sp, 0), ARG(sp, 1), 7, sp + 1);
+}
+
+static uint32_t accel_7(uint32_t *sp)
+{
+    return op__pr(ARG(sp, 0), ARG(sp, 1), 7, sp + 1);
+}
+
+static uint32_t accel_8(uint32_t *sp)
+{
+    return cp__tab(ARG(sp, 0), ARG(sp, 1), num_attr_bytes, sp + 1);
+}
+
+static uint32_t accel_9(uint32_t *sp)
+{
+    return ra__pr(ARG(sp, 0), ARG(sp, 1), num_attr_bytes, sp + 1);
+}
+
+static uint32_t accel_10(uint32_t *sp)
+{
+    return rl__pr(ARG(sp, 0), ARG(sp, 1), num_attr_bytes, sp + 1);
+}
+
+static uint32_t accel_11(uint32_t *sp)
+{
+    return oc__cl(ARG(sp, 0), ARG(sp, 1), num_attr_bytes, sp + 1);
+}
+
+static uint32_t accel_12(uint32_t *sp)
+{
+    return rv__pr(ARG(sp, 0), ARG(sp, 1), num_attr_bytes, sp + 1);
+}
+
+static uint32_t accel_13(uint32_t *sp)
+{
+    return op__pr(ARG(sp, 0), ARG(sp, 1), num_attr_bytes, sp + 1);
+}
+
+static uint32_t (* const accel_funcs[NUM_ACCEL_FUNCS + 1])(uint32_t*) = {
+    0, &accel_1, &accel_2, &accel_3, &accel_4, &accel_5, &accel_6,
+    &accel_7, &accel_8, &accel_9, &accel_10, &accel_11, &accel_12,
+    &accel_13 };
+
+uint32_t native_accel_supported(uint32_t index)
+{
+    return index > 0 && index <= NUM_ACCEL_FUNCS;
+}
+
+uint32_t (*native_accel_original(uint32_t addr))(uint32_t*)
+{
+    int n;
+    for (n = 0; n < num_accelerated; ++n)
+    {
+        if (accelerated[n].addr == addr) return accelerated[n].original;
+    }
+    return func(addr);
+}
+
+void native_accelfunc(uint32_t index, uint32_t addr)
+{
+    int n;
+
+    if (addr >= init_ramstart)
+    {
+        error("cannot accelerate function at offset 0x%08x", addr);
+        return;
+    }
+
+    /* Find existing entry for this function: */
+    for (n = 0; n < num_accelerated; ++n)
+    {
+        if (accelerated[n].addr == addr) break;
+    }
+
+    if (index == 0 || !native_accel_supported(index))
+    {
+        /* Restore the translated function (silently ignoring unsupported
+           functions, as the Glulx spec requires) */
+        if (n < num_accelerated)
+        {
+            func_entry(addr)->ptr = accelerated[n].original;
+            accelerated[n] = accelerated[--num_accelerated];
+            call_caches_reset();
+        }
+        return;
+    }
+
+    if (n == num_accelerated)
+    {
+        if (func(addr) == NULL)
+        {
+            error("cannot accelerate non-function at offset 0x%08x", addr);
+            return;
+        }
+        if (num_accelerated == MAX_ACCELERATED)
+        {
+            error("too many accelerated functions");
+            return;
+        }
+        accelerated[n].addr     = addr;
+        accelerated[n].original = func(addr);
+        ++num_accelerated;
+    }
+    func_entry(addr)->ptr = accel_funcs[index];
+    call_caches_reset();
+}
+
+void native_accelparam(uint32_t index, uint32_t value)
+{
+    switch (index)
+    {
+    case 0: classes_table       = value; break;
+    case 1: indiv_prop_start    = value; break;
+    case 2: class_metaclass     = value; break;
+    case 3: object_metaclass    = value; break;
+    case 4: routine_metaclass   = value; break;
+    case 5: string_metaclass    = value; break;
+    case 6: self                = value; break;
+    case 7: num_attr_bytes      = value; break;
+    case 8: cpv__start          = value; break;
+    default: break;  /* unknown parameters are ignored */
+    }
+}
@@ -0,0 +1,220 @@
+#include "native.h"
+#include "storycode.h"
+#include "messages.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Page protection of RAM that translated code assumes to be constant.
+
+   With --frozen-ram, the translator folds loads from the ranges of RAM in
+   frozen_ram[], which were never written in a profiling run.  After the
+   machine is reset, their pages are made read-only, so that a write to them
+   (which would make the folded values stale) traps and aborts with an error,
+   instead of letting the story continue with wrong values.
+
+   When compiled with NATIVE_PROFILE_RAM, all pages of initialized RAM are
+   protected instead (or only the pages listed in FROZEN_RAM_FILE, if it
+   exists, so that several runs can be combined), and each page is made
+   writable again when it is first written.  On quit, the pages that were
+   never written are saved to FROZEN_RAM_FILE, for use with --frozen-ram.
+
+   Native code that rewrites memory as a whole (reset, restore and undo) calls
+   frozen_ram_unprotect() first, and frozen_ram_protect() afterwards, which
+   checks that the protected pages still hold their initial contents. */
+
+#define FROZEN_RAM_FILE "frozen-ram.txt"
+
+#ifndef WIN32
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static uint32_t page_size = 0;
+static bool *frozen = NULL;     /* indexed by page number */
+
+static void frozen_ram_fault(int sig, siginfo_t *si, void *uc)
+{
+    uintptr_t offset = (uintptr_t)si->si_addr - (uintptr_t)mem;
+
+    if (offset < MAX_MEM_SIZE && frozen[offset/page_size])
+    {
+#ifdef NATIVE_PROFILE_RAM
+        /* Page written for the first time; the write is retried. */
+        frozen[offset/page_size] = false;
+        mprotect(mem + offset/page_size*page_size, page_size,
+                 PROT_READ|PROT_WRITE);
+        return;
+#else
+        fatal("write to frozen RAM at offset 0x%08x (translate the story "
+              "again without --frozen-ram)", (uint32_t)offset);
+#endif
+    }
+
+    /* Any other fault crashes as before: */
+    signal(sig, SIG_DFL);
+    (void)uc;
+}
+
+/* Marks pages that lie within [start, end) as frozen. */
+static void freeze_range(uint32_t start, uint32_t end)
+{
+    uint32_t page;
+
+    for (page = (start + page_size - 1)/page_size;
+         (page + 1)*page_size <= end; ++page)
+    {
+        frozen[page] = true;
+    }
+}
+
+static void frozen_ram_init(void)
+{
+    extern size_t glulx_size;
+    struct sigaction sa;
+    uint32_t end = glulx_size < init_extstart ? glulx_size : init_extstart;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    if ((uintptr_t)mem%page_size != 0)
+        fatal("memory is not aligned to pages, so RAM cannot be frozen");
+    frozen = calloc(MAX_MEM_SIZE/page_size, sizeof(bool));
+    assert(frozen != NULL);
+
+#ifdef NATIVE_PROFILE_RAM
+    {
+        FILE *fp = fopen(FROZEN_RAM_FILE, "rt");
+        uint32_t start, stop;
+
+        if (fp == NULL)
+        {
+            freeze_range(init_ramstart, end);
+        }
+        else
+        {
+            while (fscanf(fp, "%x %x", &start, &stop) == 2)
+            {
+                freeze_range(start, stop < end ? stop : end);
+            }
+            fclose(fp);
+            info("profiling writes to RAM not written in " FROZEN_RAM_FILE);
+        }
+    }
+#else
+    {
+        const struct FrozenRange *range;
+
+        for (range = frozen_ram; range->end != 0; ++range)
+        {
+            if (range->start%page_size != 0 || range->end%page_size != 0 ||
+                range->end > end)
+            {
+                fatal("frozen RAM range 0x%08x-0x%08x does not match the "
+                      "pages of memory", range->start, range->end);
+            }
+            freeze_range(range->start, range->end);
+        }
+    }
+#endif
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = frozen_ram_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL) != 0)
+        fatal("could not install handler for writes to frozen RAM");
+}
+
+void frozen_ram_protect(void)
+{
+    extern const uint8_t *glulx_data;
+    uint32_t page;
+
+    if (frozen == NULL)
+    {
+#ifndef NATIVE_PROFILE_RAM
+        if (frozen_ram[0].end == 0) return;
+#endif
+        frozen_ram_init();
+    }
+
+    for (page = init_ramstart/page_size; page < MAX_MEM_SIZE/page_size; ++page)
+    {
+        if (!frozen[page]) continue;
+        if (memcmp(mem + page*page_size, glulx_data + page*page_size,
+                   page_size) != 0)
+        {
+#ifdef NATIVE_PROFILE_RAM
+            frozen[page] = false;
+            continue;
+#else
+            fatal("frozen RAM at offset 0x%08x was changed (translate the "
+                  "story again without --frozen-ram)", page*page_size);
+#endif
+        }
+        mprotect(mem + page*page_size, page_size, PROT_READ);
+    }
+}
+
+void frozen_ram_unprotect(void)
+{
+    uint32_t page;
+
+    if (frozen == NULL) return;
+    for (page = init_ramstart/page_size; page < MAX_MEM_SIZE/page_size; ++page)
+    {
+        if (frozen[page])
+            mprotect(mem + page*page_size, page_size, PROT_READ|PROT_WRITE);
+    }
+}
+
+void frozen_ram_report(void)
+{
+#ifdef NATIVE_PROFILE_RAM
+    FILE *fp;
+    uint32_t page, start, total = 0;
+
+    if (frozen == NULL) return;
+    fp = fopen(FROZEN_RAM_FILE, "wt");
+    if (fp == NULL)
+    {
+        error("could not write " FROZEN_RAM_FILE);
+        return;
+    }
+    for (page = init_ramstart/page_size; page < MAX_MEM_SIZE/page_size; )
+    {
+        if (!frozen[page])
+        {
+            ++page;
+            continue;
+        }
+        start = page;
+        while (page < MAX_MEM_SIZE/page_size && frozen[page]) ++page;
+        fprintf(fp, "%08x %08x\n", start*page_size, page*page_size);
+        total += (page - start)*page_size;
+    }
+    fclose(fp);
+    info("%u bytes of RAM never written (saved to " FROZEN_RAM_FILE ")", total);
+#endif
+}
+
+#else /* def WIN32 */
+
+/* Page protection is not implemented here, so stories can't be profiled or
+   translated with --frozen-ram. */
+
+void frozen_ram_protect(void)
+{
+    if (frozen_ram[0].end != 0)
+        fatal("frozen RAM is not supported on this platform");
+}
+
+void frozen_ram_unprotect(void)
+{
+}
+
+void frozen_ram_report(void)
+{
+}
+
+#endif /* def WIN32 */
@@ -0,0 +1,322 @@
+#include "native.h"
+#include "glkop.h"
+
+/* Direct entry points for Glk functions.  For glk instructions with a
+   constant selector and argument count, translated code calls the function
+   below that matches the selector (see glk_stubs in glulx-to-c.py) with the
+   arguments popped off the stack, instead of calling native_glk(), which
+   copies the arguments and parses the function's prototype on every call.
+
+   Only functions whose arguments are integers, characters, opaque objects and
+   strings or character arrays that are only read are included.  Functions
+   that take references, structures or arrays that Glk writes to still go
+   through perform_glk(), which handles them in general.
+
+   Opaque objects are passed by ID; classes are numbered as in the dispatch
+   layer: */
+
+#define CLASS_WINDOW    0
+#define CLASS_STREAM    1
+#define CLASS_FILEREF   2
+
+#define WIN(id)     ((winid_t)find_object_by_id(CLASS_WINDOW, (id)))
+#define STR(id)     ((strid_t)find_object_by_id(CLASS_STREAM, (id)))
+#define FREF(id)    ((frefid_t)find_object_by_id(CLASS_FILEREF, (id)))
+
+#define WIN_ID(win)     find_id_for_object(CLASS_WINDOW, (win))
+#define STR_ID(str)     find_id_for_object(CLASS_STREAM, (str))
+#define FREF_ID(fref)   find_id_for_object(CLASS_FILEREF, (fref))
+
+uint32_t native_glk_tick(void)
+{
+    glk_tick();
+    return 0;
+}
+
+uint32_t native_glk_gestalt(uint32_t sel, uint32_t val)
+{
+    return glk_gestalt(sel, val);
+}
+
+uint32_t native_glk_window_get_rock(uint32_t win)
+{
+    return glk_window_get_rock(WIN(win));
+}
+
+uint32_t native_glk_window_get_root(void)
+{
+    return WIN_ID(glk_window_get_root());
+}
+
+uint32_t native_glk_window_open(uint32_t split, uint32_t method, uint32_t size,
+                                uint32_t wintype, uint32_t rock)
+{
+    return WIN_ID(glk_window_open(WIN(split), method, size, wintype, rock));
+}
+
+uint32_t native_glk_window_set_arrangement(uint32_t win, uint32_t method,
+                                           uint32_t size, uint32_t keywin)
+{
+    glk_window_set_arrangement(WIN(win), method, size, WIN(keywin));
+    return 0;
+}
+
+uint32_t native_glk_window_get_type(uint32_t win)
+{
+    return glk_window_get_type(WIN(win));
+}
+
+uint32_t native_glk_window_get_parent(uint32_t win)
+{
+    return WIN_ID(glk_window_get_parent(WIN(win)));
+}
+
+uint32_t native_glk_window_clear(uint32_t win)
+{
+    glk_window_clear(WIN(win));
+    return 0;
+}
+
+uint32_t native_glk_window_move_cursor(uint32_t win, uint32_t x, uint32_t y)
+{
+    glk_window_move_cursor(WIN(win), x, y);
+    return 0;
+}
+
+uint32_t native_glk_window_get_stream(uint32_t win)
+{
+    return STR_ID(glk_window_get_stream(WIN(win)));
+}
+
+uint32_t native_glk_window_set_echo_stream(uint32_t win, uint32_t str)
+{
+    glk_window_set_echo_stream(WIN(win), STR(str));
+    return 0;
+}
+
+uint32_t native_glk_window_get_echo_stream(uint32_t win)
+{
+    return STR_ID(glk_window_get_echo_stream(WIN(win)));
+}
+
+uint32_t native_glk_set_window(uint32_t win)
+{
+    glk_set_window(WIN(win));
+    return 0;
+}
+
+uint32_t native_glk_window_get_sibling(uint32_t win)
+{
+    return WIN_ID(glk_window_get_sibling(WIN(win)));
+}
+
+uint32_t native_glk_stream_get_rock(uint32_t str)
+{
+    return glk_stream_get_rock(STR(str));
+}
+
+uint32_t native_glk_stream_open_file(uint32_t fref, uint32_t mode,
+                                     uint32_t rock)
+{
+    return STR_ID(glk_stream_open_file(FREF(fref), mode, rock));
+}
+
+uint32_t native_glk_stream_set_position(uint32_t str, uint32_t pos,
+                                        uint32_t mode)
+{
+    glk_stream_set_position(STR(str), (glsi32)pos, mode);
+    return 0;
+}
+
+uint32_t native_glk_stream_get_position(uint32_t str)
+{
+    return glk_stream_get_position(STR(str));
+}
+
+uint32_t native_glk_stream_set_current(uint32_t str)
+{
+    glk_stream_set_current(STR(str));
+    return 0;
+}
+
+uint32_t native_glk_stream_get_current(void)
+{
+    return STR_ID(glk_stream_get_current());
+}
+
+uint32_t native_glk_fileref_create_temp(uint32_t usage, uint32_t rock)
+{
+    return FREF_ID(glk_fileref_create_temp(usage, rock));
+}
+
+uint32_t native_glk_fileref_create_by_prompt(uint32_t usage, uint32_t fmode,
+                                             uint32_t rock)
+{
+    return FREF_ID(glk_fileref_create_by_prompt(usage, fmode, rock));
+}
+
+uint32_t native_glk_fileref_destroy(uint32_t fref)
+{
+    glk_fileref_destroy(FREF(fref));
+    return 0;
+}
+
+uint32_t native_glk_fileref_get_rock(uint32_t fref)
+{
+    return glk_fileref_get_rock(FREF(fref));
+}
+
+uint32_t native_glk_fileref_delete_file(uint32_t fref)
+{
+    glk_fileref_delete_file(FREF(fref));
+    return 0;
+}
+
+uint32_t native_glk_fileref_does_file_exist(uint32_t fref)
+{
+    return glk_fileref_does_file_exist(FREF(fref));
+}
+
+uint32_t native_glk_fileref_create_from_fileref(uint32_t usage, uint32_t fref,
+                                                uint32_t rock)
+{
+    return FREF_ID(glk_fileref_create_from_fileref(usage, FREF(fref), rock));
+}
+
+uint32_t native_glk_put_char(uint32_t ch)
+{
+    glk_put_char(ch & 0xff);
+    return 0;
+}
+
+uint32_t native_glk_put_char_stream(uint32_t str, uint32_t ch)
+{
+    glk_put_char_stream(STR(str), ch & 0xff);
+    return 0;
+}
+
+uint32_t native_glk_put_string(uint32_t s)
+{
+    glk_put_string((char*)&mem[s + 1]);
+    return 0;
+}
+
+uint32_t native_glk_put_string_stream(uint32_t str, uint32_t s)
+{
+    glk_put_string_stream(STR(str), (char*)&mem[s + 1]);
+    return 0;
+}
+
+uint32_t native_glk_put_buffer(uint32_t buf, uint32_t len)
+{
+    glk_put_buffer((char*)&mem[buf], len);
+    return 0;
+}
+
+uint32_t native_glk_put_buffer_stream(uint32_t str, uint32_t buf, uint32_t len)
+{
+    glk_put_buffer_stream(STR(str), (char*)&mem[buf], len);
+    return 0;
+}
+
+uint32_t native_glk_set_style(uint32_t styl)
+{
+    glk_set_style(styl);
+    return 0;
+}
+
+uint32_t native_glk_set_style_stream(uint32_t str, uint32_t styl)
+{
+    glk_set_style_stream(STR(str), styl);
+    return 0;
+}
+
+uint32_t native_glk_get_char_stream(uint32_t str)
+{
+    return glk_get_char_stream(STR(str));
+}
+
+uint32_t native_glk_char_to_lower(uint32_t ch)
+{
+    return glk_char_to_lower(ch & 0xff);
+}
+
+uint32_t native_glk_char_to_upper(uint32_t ch)
+{
+    return glk_char_to_upper(ch & 0xff);
+}
+
+uint32_t native_glk_stylehint_set(uint32_t wintype, uint32_t styl,
+                                  uint32_t hint, uint32_t val)
+{
+    glk_stylehint_set(wintype, styl, hint, (glsi32)val);
+    return 0;
+}
+
+uint32_t native_glk_stylehint_clear(uint32_t wintype, uint32_t styl,
+                                    uint32_t hint)
+{
+    glk_stylehint_clear(wintype, styl, hint);
+    return 0;
+}
+
+uint32_t native_glk_request_char_event(uint32_t win)
+{
+    glk_request_char_event(WIN(win));
+    return 0;
+}
+
+uint32_t native_glk_cancel_char_event(uint32_t win)
+{
+    glk_cancel_char_event(WIN(win));
+    return 0;
+}
+
+uint32_t native_glk_request_mouse_event(uint32_t win)
+{
+    glk_request_mouse_event(WIN(win));
+    return 0;
+}
+
+uint32_t native_glk_cancel_mouse_event(uint32_t win)
+{
+    glk_cancel_mouse_event(WIN(win));
+    return 0;
+}
+
+uint32_t native_glk_request_timer_events(uint32_t millisecs)
+{
+    glk_request_timer_events(millisecs);
+    return 0;
+}
+
+uint32_t native_glk_put_char_uni(uint32_t ch)
+{
+    glk_put_char_uni(ch);
+    return 0;
+}
+
+uint32_t native_glk_put_string_uni(uint32_t s)
+{
+    uint32_t *p = native_ustring_dup(s + 4);
+    glk_put_string_uni(p);
+    free(p);
+    return 0;
+}
+
+uint32_t native_glk_put_char_stream_uni(uint32_t str, uint32_t ch)
+{
+    glk_put_char_stream_uni(STR(str), ch);
+    return 0;
+}
+
+uint32_t native_glk_get_char_stream_uni(uint32_t str)
+{
+    return glk_get_char_stream_uni(STR(str));
+}
+
+uint32_t native_glk_request_char_event_uni(uint32_t win)
+{
+    glk_request_char_event_uni(WIN(win));
+    return 0;
+}
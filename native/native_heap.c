@@ -0,0 +1,314 @@
+#include "native.h"
+#include "messages.h"
+#include "storycode.h"
+#include <assert.h>
+#include <stdbool.h>
+
+/* Memory resizing and the Glulx heap (setmemsize, malloc and mfree).
+
+   The memory size can be changed in multiples of 256 bytes, between ENDMEM
+   and MAX_MEM_SIZE.  The heap starts at the end of memory when the first
+   block is allocated; memory then grows as blocks are added, and shrinks back
+   to heap_start when the last block is freed.  While the heap is in use,
+   setmemsize fails.
+
+   Block bookkeeping is kept outside Glulx memory, so the game cannot corrupt
+   it.  Block sizes are rounded up to HEAP_GRANULE bytes.  Freed blocks up to
+   NUM_SIZE_CLASSES granules are kept on a free list per size, so the common
+   case of reallocating a block of the same size takes O(1) time; larger free
+   blocks are kept on a single list that is searched first-fit.  Without a
+   free block of the requested size, a larger one is split.  A freed block is
+   merged with adjacent free blocks, so that the heap doesn't fragment as
+   blocks come and go. */
+
+#define HEAP_GRANULE        16
+#define NUM_SIZE_CLASSES    64
+#define FREE_BLOCK          0x80000000u
+
+/* Current memory size, as returned by getmemsize */
+uint32_t mem_size = 0;
+
+static uint32_t heap_start = 0;     /* start of the heap, or 0 if inactive */
+static uint32_t heap_top   = 0;     /* end of the last block */
+static uint32_t num_blocks = 0;     /* number of allocated blocks */
+
+/* Block sizes in granules, indexed by offset from heap_start in granules.
+   Entries for the first granule of a block hold its size (with FREE_BLOCK
+   set if the block is free), as do entries for the last granule of a free
+   block, so that mfree can find a free block that precedes the freed one;
+   other entries are 0. */
+static uint32_t *block_map     = NULL;
+static uint32_t  block_map_len = 0;
+
+/* Free blocks are linked in doubly-linked lists through free_links[], which
+   is indexed like block_map[], by granule index plus one (0 ends a list).
+   free_lists[n] holds blocks of n granules for 0 < n < NUM_SIZE_CLASSES;
+   free_lists[0] holds all larger blocks. */
+static struct FreeLink
+{
+    uint32_t prev, next;
+} *free_links = NULL;
+static uint32_t free_lists[NUM_SIZE_CLASSES];
+
+static uint32_t *free_list(uint32_t granules)
+{
+    return &free_lists[granules < NUM_SIZE_CLASSES ? granules : 0];
+}
+
+static void push_free(uint32_t addr, uint32_t granules)
+{
+    uint32_t index = (addr - heap_start)/HEAP_GRANULE;
+    uint32_t *list = free_list(granules);
+
+    free_links[index].prev = 0;
+    free_links[index].next = *list;
+    if (*list != 0) free_links[*list - 1].prev = index + 1;
+    *list = index + 1;
+    block_map[index] = block_map[index + granules - 1] = granules | FREE_BLOCK;
+}
+
+/* Removes the free block at granule `index' from its free list. */
+static void remove_free(uint32_t index)
+{
+    uint32_t granules = block_map[index] & ~FREE_BLOCK;
+    struct FreeLink *link = &free_links[index];
+
+    if (link->prev != 0)
+        free_links[link->prev - 1].next = link->next;
+    else
+        *free_list(granules) = link->next;
+    if (link->next != 0) free_links[link->next - 1].prev = link->prev;
+    block_map[index] = block_map[index + granules - 1] = 0;
+}
+
+/* Changes the memory size, zeroing any memory that is added. */
+static bool resize_memory(uint32_t new_size)
+{
+    if (new_size%256 != 0 || new_size < init_endmem || new_size > MAX_MEM_SIZE)
+        return false;
+    if (new_size > mem_size) memset(mem + mem_size, 0, new_size - mem_size);
+    mem_size = new_size;
+    return true;
+}
+
+/* Extends the heap by a new block at heap_top, growing memory if needed. */
+static uint32_t grow_heap(uint32_t granules)
+{
+    uint32_t addr = heap_top, index = (addr - heap_start)/HEAP_GRANULE;
+
+    if (granules > (MAX_MEM_SIZE - heap_top)/HEAP_GRANULE) return 0;
+    if (heap_top + granules*HEAP_GRANULE > mem_size &&
+        !resize_memory((heap_top + granules*HEAP_GRANULE + 255)/256*256))
+        return 0;
+
+    if (index + granules > block_map_len)
+    {
+        uint32_t len = block_map_len ? block_map_len : 1024;
+        while (len < index + granules) len *= 2;
+        block_map = realloc(block_map, sizeof(uint32_t)*len);
+        free_links = realloc(free_links, sizeof(struct FreeLink)*len);
+        assert(block_map != NULL && free_links != NULL);
+        memset(block_map + block_map_len, 0,
+               sizeof(uint32_t)*(len - block_map_len));
+        block_map_len = len;
+    }
+    heap_top += granules*HEAP_GRANULE;
+    return addr;
+}
+
+/* Takes a block of the given size from the free lists, or returns 0. */
+static uint32_t reuse_block(uint32_t granules)
+{
+    uint32_t c, n = 0, size;
+
+    /* Try a block of the same size class, then of larger classes, and then
+       the first large block that fits: */
+    for (c = granules; c > 0 && c < NUM_SIZE_CLASSES && n == 0; ++c)
+        n = free_lists[c];
+    if (n == 0)
+    {
+        for (n = free_lists[0]; n != 0; n = free_links[n - 1].next)
+            if ((block_map[n - 1] & ~FREE_BLOCK) >= granules) break;
+        if (n == 0) return 0;
+    }
+
+    size = block_map[n - 1] & ~FREE_BLOCK;
+    remove_free(n - 1);
+    if (size > granules)
+    {
+        /* Split off the remainder */
+        push_free(heap_start + (n - 1 + granules)*HEAP_GRANULE,
+                  size - granules);
+    }
+    return heap_start + (n - 1)*HEAP_GRANULE;
+}
+
+static void clear_heap(void)
+{
+    int n;
+
+    for (n = 0; n < NUM_SIZE_CLASSES; ++n) free_lists[n] = 0;
+    if (block_map != NULL) memset(block_map, 0, sizeof(uint32_t)*block_map_len);
+    heap_start = heap_top = num_blocks = 0;
+}
+
+uint32_t native_heapstart(void)
+{
+    return heap_start;
+}
+
+uint32_t native_malloc(uint32_t size)
+{
+    uint32_t granules, addr;
+
+    if (size == 0 || size > MAX_MEM_SIZE) return 0;
+    granules = (size + HEAP_GRANULE - 1)/HEAP_GRANULE;
+
+    if (heap_start == 0)
+    {
+        heap_start = heap_top = mem_size;
+    }
+
+    addr = reuse_block(granules);
+    if (addr == 0)
+    {
+        addr = grow_heap(granules);
+        if (addr == 0)
+        {
+            if (num_blocks == 0) clear_heap();
+            return 0;
+        }
+    }
+    block_map[(addr - heap_start)/HEAP_GRANULE] = granules;
+    ++num_blocks;
+    return addr;
+}
+
+void native_mfree(uint32_t addr)
+{
+    uint32_t index, granules;
+
+    index = (addr - heap_start)/HEAP_GRANULE;
+    if (heap_start == 0 || addr < heap_start || addr >= heap_top ||
+        (addr - heap_start)%HEAP_GRANULE != 0 ||
+        block_map[index] == 0 || (block_map[index] & FREE_BLOCK))
+    {
+        fatal("attempt to free unallocated memory at offset 0x%08x", addr);
+        return;
+    }
+    granules = block_map[index];
+
+    if (--num_blocks == 0)
+    {
+        /* Last block freed: deactivate the heap */
+        resize_memory(heap_start);
+        clear_heap();
+        return;
+    }
+
+    /* Merge with the free blocks after and before it, if any: */
+    block_map[index] = 0;
+    if (addr + granules*HEAP_GRANULE < heap_top &&
+        (block_map[index + granules] & FREE_BLOCK))
+    {
+        uint32_t next = block_map[index + granules] & ~FREE_BLOCK;
+        remove_free(index + granules);
+        granules += next;
+    }
+    if (index > 0 && (block_map[index - 1] & FREE_BLOCK))
+    {
+        uint32_t prev = block_map[index - 1] & ~FREE_BLOCK;
+        remove_free(index - prev);
+        index -= prev;
+        granules += prev;
+        addr = heap_start + index*HEAP_GRANULE;
+    }
+
+    if (addr + granules*HEAP_GRANULE == heap_top)
+    {
+        /* Topmost block: shrink the heap instead */
+        heap_top = addr;
+        return;
+    }
+
+    push_free(addr, granules);
+}
+
+uint32_t native_setmemsize(uint32_t new_size)
+{
+    if (heap_start != 0)
+    {
+        error("cannot resize memory while the heap is active");
+        return 1;
+    }
+    return resize_memory(new_size) ? 0 : 1;
+}
+
+void native_heap_reset(void)
+{
+    clear_heap();
+    mem_size = init_endmem;
+}
+
+/* Serialized heap state consists of 4-byte words (in native byte-order):
+
+    heap start address (or 0 if the heap is inactive)
+    number of allocated blocks, N
+    N pairs of block address and size in bytes, in increasing address order
+
+   If `data' is NULL, only the size of the state in bytes is returned. */
+size_t native_heap_serialize(char *data)
+{
+    uint32_t *pos = (uint32_t*)data, index;
+
+    if (data != NULL)
+    {
+        *pos++ = heap_start;
+        *pos++ = num_blocks;
+        for (index = 0; index < (heap_top - heap_start)/HEAP_GRANULE; ++index)
+        {
+            uint32_t granules = block_map[index];
+            if (granules != 0 && !(granules & FREE_BLOCK))
+            {
+                *pos++ = heap_start + index*HEAP_GRANULE;
+                *pos++ = granules*HEAP_GRANULE;
+            }
+        }
+        assert((char*)pos == data + 4*(2 + 2*num_blocks));
+    }
+    return 4*(2 + 2*num_blocks);
+}
+
+/* Restores the heap state from `data'.  The memory size must have been set
+   before.  Gaps between allocated blocks are added to the free lists. */
+void native_heap_deserialize(const char *data, size_t size)
+{
+    const uint32_t *pos = (const uint32_t*)data;
+    uint32_t start, count, n;
+
+    assert(size >= 8);
+    start = pos[0];
+    count = pos[1];
+    assert(size == 4*(2 + 2*count));
+
+    clear_heap();
+    if (start == 0) return;
+    heap_start = heap_top = start;
+    for (n = 0; n < count; ++n)
+    {
+        uint32_t addr = pos[2 + 2*n], granules = pos[3 + 2*n]/HEAP_GRANULE;
+
+        assert(addr >= heap_top && (addr - heap_top)%HEAP_GRANULE == 0);
+        if (addr > heap_top)
+        {
+            uint32_t gap = (addr - heap_top)/HEAP_GRANULE, free_addr;
+            free_addr = grow_heap(gap);
+            assert(free_addr != 0);
+            push_free(free_addr, gap);
+        }
+        addr = grow_heap(granules);
+        assert(addr != 0);
+        block_map[(addr - heap_start)/HEAP_GRANULE] = granules;
+    }
+    num_blocks = count;
+}
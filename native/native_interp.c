@@ -0,0 +1,602 @@
+#include "native.h"
+#include "messages.h"
+#include "storycode.h"
+#include <alloca.h>
+#include <stdbool.h>
+#include <string.h>
+
+/* A simple Glulx interpreter for code that the translator cannot compile:
+   functions outside ROM, absolute jumps and indirect jump targets.
+
+   The interpreter shares memory and the data stack with translated code, and
+   uses the same calling convention (see storycode.h).  Calls to translated
+   functions go through func_table[] as usual, so execution returns to native
+   code at the next function boundary.  Since the interpreter writes global
+   variables to memory only, it reloads the copies that translated code keeps
+   whenever control passes back to translated code. */
+
+#define MAX_OPERANDS    8
+
+struct Frame
+{
+    uint32_t addr;          /* address of the function being executed */
+    uint32_t pc;            /* address of the next instruction */
+    uint32_t *bp;           /* base of the current stack frame */
+    uint32_t *sp;           /* top of the data stack */
+    uint8_t  *locals;       /* local variables (in native byte order) */
+    struct CatchStub *catch;  /* stub pushed by the last catch instruction */
+};
+
+/* Returns the operand types of the instruction with the given opcode:
+   `l' for loaded operands, `s' for stored operands and `b' for branch
+   offsets (which are loaded too), or NULL if the opcode is invalid. */
+static const char *operand_types(uint32_t opcode)
+{
+    switch (opcode)
+    {
+    case 0x00: case 0x52: case 0x120: case 0x122:
+        return "";
+    case 0x31: case 0x54: case 0x70: case 0x71: case 0x72: case 0x73:
+    case 0x101: case 0x104: case 0x111: case 0x141: case 0x179:
+        return "l";
+    case 0x50: case 0x102: case 0x121: case 0x125: case 0x126: case 0x140:
+        return "s";
+    case 0x148:
+        return "ss";
+    case 0x20:
+        return "b";
+    case 0x22: case 0x23: case 0x1c8: case 0x1c9:
+        return "lb";
+    case 0x24: case 0x25: case 0x26: case 0x27: case 0x28: case 0x29:
+    case 0x2a: case 0x2b: case 0x2c: case 0x2d:
+    case 0x1c2: case 0x1c3: case 0x1c4: case 0x1c5:
+        return "llb";
+    case 0x1c0: case 0x1c1:
+        return "lllb";
+    case 0x15: case 0x1b: case 0x40: case 0x41: case 0x42: case 0x44:
+    case 0x45: case 0x51: case 0x103: case 0x110: case 0x123: case 0x124:
+    case 0x160: case 0x178: case 0x190: case 0x191: case 0x192: case 0x198:
+    case 0x199: case 0x1a8: case 0x1a9: case 0x1aa: case 0x1b0: case 0x1b1:
+    case 0x1b2: case 0x1b3: case 0x1b4: case 0x1b5:
+        return "ls";
+    case 0x32:
+        return "sb";
+    case 0x33: case 0x34: case 0x53: case 0x127: case 0x149: case 0x170:
+    case 0x180: case 0x181:
+        return "ll";
+    case 0x10: case 0x11: case 0x12: case 0x13: case 0x14: case 0x18:
+    case 0x19: case 0x1a: case 0x1c: case 0x1d: case 0x1e: case 0x30:
+    case 0x48: case 0x49: case 0x4a: case 0x4b: case 0x100: case 0x130:
+    case 0x161: case 0x1a0: case 0x1a1: case 0x1a2: case 0x1a3: case 0x1ab:
+    case 0x1b6:
+        return "lls";
+    case 0x4c: case 0x4d: case 0x4e: case 0x4f: case 0x171:
+        return "lll";
+    case 0x162: return "llls";
+    case 0x163: return "lllls";
+    case 0x1a4: return "llss";
+    case 0x150: case 0x151: return "llllllls";
+    case 0x152: return "lllllls";
+    default: return NULL;
+    }
+}
+
+/* Reads the operand data for an operand with the given addressing mode at
+   `*pc', and returns the immediate value, memory address or local offset. */
+static uint32_t decode_operand(uint32_t mode, uint32_t *pc)
+{
+    uint32_t v;
+
+    switch (mode)
+    {
+    case 0x0: case 0x8: return 0;
+    case 0x1: v = (int8_t)get_byte(*pc);  *pc += 1; return v;
+    case 0x2: v = (int16_t)get_shrt(*pc); *pc += 2; return v;
+    case 0x3: v = get_long(*pc);          *pc += 4; return v;
+    case 0x5: case 0x9: case 0xd: v = get_byte(*pc); *pc += 1; break;
+    case 0x6: case 0xa: case 0xe: v = get_shrt(*pc); *pc += 2; break;
+    case 0x7: case 0xb: case 0xf: v = get_long(*pc); *pc += 4; break;
+    default:
+        fatal("invalid operand mode %d at offset 0x%08x", mode, *pc);
+        return 0;
+    }
+    if (mode >= 0xd) v += init_ramstart;
+    return v;
+}
+
+/* Loads an operand of `size' bytes (4, or 2 and 1 for copys and copyb) */
+static uint32_t load(struct Frame *f, uint32_t mode, uint32_t arg, int size)
+{
+    uint32_t mask = size == 4 ? 0xffffffffu : size == 2 ? 0xffffu : 0xffu;
+    uint32_t l;
+    uint16_t s;
+    uint8_t  b;
+
+    if (mode <= 0x3) return arg & mask;
+    if (mode == 0x8) return *--f->sp & mask;
+    if (mode >= 0x9 && mode <= 0xb)
+    {
+        switch (size)
+        {
+        case 4: memcpy(&l, f->locals + arg, 4); return l;
+        case 2: memcpy(&s, f->locals + arg, 2); return s;
+        case 1: memcpy(&b, f->locals + arg, 1); return b;
+        }
+    }
+    switch (size)
+    {
+    case 4: return get_long(arg);
+    case 2: return get_shrt(arg);
+    case 1: return get_byte(arg);
+    }
+    return 0;
+}
+
+/* Stores a value of `size' bytes in a store operand */
+static void store(struct Frame *f, uint32_t mode, uint32_t arg, uint32_t value,
+                  int size)
+{
+    uint16_t s = value;
+    uint8_t  b = value;
+
+    if (mode == 0x0) return;
+    if (mode == 0x8)
+    {
+        *f->sp++ = size == 4 ? value : size == 2 ? s : b;
+        return;
+    }
+    if (mode >= 0x9 && mode <= 0xb)
+    {
+        switch (size)
+        {
+        case 4: memcpy(f->locals + arg, &value, 4); return;
+        case 2: memcpy(f->locals + arg, &s, 2); return;
+        case 1: memcpy(f->locals + arg, &b, 1); return;
+        }
+    }
+    if (mode <= 0x3)
+    {
+        fatal("invalid store operand mode %d in function 0x%08x",
+              mode, f->addr);
+    }
+    switch (size)
+    {
+    case 4: set_long(arg, value); return;
+    case 2: set_shrt(arg, s); return;
+    case 1: set_byte(arg, b); return;
+    }
+}
+
+/* Returns the size of the locals of the function at `addr', and the address
+   of its first instruction in `*code'. */
+static uint32_t locals_size(uint32_t addr, uint32_t *code)
+{
+    uint32_t pos = addr + 1, size = 0, local_size, count;
+
+    while ((local_size = get_byte(pos)) != 0)
+    {
+        count = get_byte(pos + 1);
+        size = (size + local_size - 1)/local_size*local_size;
+        size += local_size*count;
+        pos += 2;
+    }
+    *code = pos + 2;
+    return (size + 3)/4*4;
+}
+
+/* Copies call arguments to the locals of a local-argument function */
+static void set_args(uint32_t addr, uint8_t *locals,
+                     const uint32_t *sp, uint32_t narg)
+{
+    uint32_t pos = addr + 1, offset = 0, local_size, count, n = 0;
+
+    while ((local_size = get_byte(pos)) != 0 && n < narg)
+    {
+        offset = (offset + local_size - 1)/local_size*local_size;
+        for (count = get_byte(pos + 1); count > 0 && n < narg; --count)
+        {
+            uint32_t v = sp[-1 - (int)n++];
+            uint16_t s = v;
+            uint8_t  b = v;
+            if (local_size == 4) memcpy(locals + offset, &v, 4);
+            if (local_size == 2) memcpy(locals + offset, &s, 2);
+            if (local_size == 1) memcpy(locals + offset, &b, 1);
+            offset += local_size;
+        }
+        pos += 2;
+    }
+}
+
+/* Calls the function at `addr' with `narg' arguments on the stack below sp */
+static uint32_t call(uint32_t addr, uint32_t narg, uint32_t *sp)
+{
+    *sp = narg;
+    globals_reload();
+    return call_func(addr, sp);
+}
+
+/* Decodes the instruction at `pc' and returns the offset of the next one.
+   Operand modes and values are stored in `modes' and `args'. */
+static uint32_t decode(uint32_t pc, uint32_t *opcode,
+                       uint32_t *modes, uint32_t *args)
+{
+    const char *types;
+    uint32_t n;
+
+    *opcode = get_byte(pc);
+    if (*opcode < 0x80)
+    {
+        pc += 1;
+    }
+    else if (*opcode < 0xc0)
+    {
+        *opcode = get_shrt(pc) & 0x3fff;
+        pc += 2;
+    }
+    else
+    {
+        *opcode = get_long(pc) & 0x0fffffff;
+        pc += 4;
+    }
+    types = operand_types(*opcode);
+    if (types == NULL)
+    {
+        fatal("invalid opcode 0x%x at offset 0x%08x", *opcode, pc);
+        return pc;
+    }
+    for (n = 0; types[n] != '\0'; ++n)
+    {
+        modes[n] = (get_byte(pc + n/2) >> 4*(n%2)) & 0xf;
+    }
+    pc += (n + 1)/2;
+    for (n = 0; types[n] != '\0'; ++n)
+    {
+        args[n] = decode_operand(modes[n], &pc);
+    }
+    return pc;
+}
+
+/* Executes the instruction at f->pc. Returns true if the function returned,
+   with its return value in *result. The catch instruction leaves its stub in
+   f->catch, for execute() to save the context in. */
+static bool step(struct Frame *f, uint32_t *result)
+{
+    uint32_t pc = f->pc, opcode, modes[MAX_OPERANDS], args[MAX_OPERANDS];
+    uint32_t l[MAX_OPERANDS] = { 0 }, s[2] = { 0, 0 }, smode[2], saddr[2];
+    uint32_t branch = 0, n, nl = 0, ns = 0;
+    const char *types;
+    int size = 4;
+
+    f->pc = decode(pc, &opcode, modes, args);
+    types = operand_types(opcode);
+    if (opcode == 0x41) size = 2;  /* copys */
+    if (opcode == 0x42) size = 1;  /* copyb */
+
+    /* Load operands: */
+    for (n = 0; types[n] != '\0'; ++n)
+    {
+        if (types[n] == 'l')
+        {
+            l[nl++] = load(f, modes[n], args[n], size);
+        }
+        else if (types[n] == 'b')
+        {
+            branch = load(f, modes[n], args[n], 4);
+        }
+        else  /* types[n] == 's' */
+        {
+            smode[ns] = modes[n];
+            saddr[ns] = args[n];
+            ++ns;
+        }
+    }
+
+#define F(i) long_to_float(l[i])
+#define BRANCH(cond) if (cond) goto do_branch; break
+
+    switch (opcode)
+    {
+    case 0x00: break;  /* nop */
+    case 0x10: s[0] = l[0] + l[1]; break;
+    case 0x11: s[0] = l[0] - l[1]; break;
+    case 0x12: s[0] = l[0] * l[1]; break;
+    case 0x13:
+    case 0x14:
+        if (l[1] == 0) fatal("division by zero in function 0x%08x", f->addr);
+        if (opcode == 0x13) s[0] = (int32_t)l[0] / (int32_t)l[1];
+        else                s[0] = (int32_t)l[0] % (int32_t)l[1];
+        break;
+    case 0x15: s[0] = -l[0]; break;
+    case 0x18: s[0] = l[0] & l[1]; break;
+    case 0x19: s[0] = l[0] | l[1]; break;
+    case 0x1a: s[0] = l[0] ^ l[1]; break;
+    case 0x1b: s[0] = ~l[0]; break;
+    case 0x1c: s[0] = l[1] < 32 ? l[0] << l[1] : 0; break;
+    case 0x1d:
+        s[0] = l[1] < 32 ? (uint32_t)((int32_t)l[0] >> l[1])
+                         : ((int32_t)l[0] < 0 ? 0xffffffffu : 0);
+        break;
+    case 0x1e: s[0] = l[1] < 32 ? l[0] >> l[1] : 0; break;
+
+    case 0x20: goto do_branch;
+    case 0x22: BRANCH(l[0] == 0);
+    case 0x23: BRANCH(l[0] != 0);
+    case 0x24: BRANCH(l[0] == l[1]);
+    case 0x25: BRANCH(l[0] != l[1]);
+    case 0x26: BRANCH((int32_t)l[0] <  (int32_t)l[1]);
+    case 0x27: BRANCH((int32_t)l[0] >= (int32_t)l[1]);
+    case 0x28: BRANCH((int32_t)l[0] >  (int32_t)l[1]);
+    case 0x29: BRANCH((int32_t)l[0] <= (int32_t)l[1]);
+    case 0x2a: BRANCH(l[0] <  l[1]);
+    case 0x2b: BRANCH(l[0] >= l[1]);
+    case 0x2c: BRANCH(l[0] >  l[1]);
+    case 0x2d: BRANCH(l[0] <= l[1]);
+    case 0x104: f->pc = l[0]; break;  /* jumpabs */
+
+    case 0x30:  /* call */
+        f->sp -= l[1];
+        s[0] = call(l[0], l[1], f->sp + l[1]);
+        break;
+    case 0x31:  /* ret */
+        *result = l[0];
+        return true;
+    case 0x32:  /* catch */
+        f->catch = (struct CatchStub*)f->sp;
+        f->sp += CATCH_STUB_WORDS;
+        store(f, smode[0], saddr[0], native_catch(f->catch, pc), 4);
+        goto do_branch;
+    case 0x33: native_throw(l[0], l[1]); break;
+    case 0x34:  /* tailcall */
+        f->sp -= l[1];
+        *result = call(l[0], l[1], f->sp + l[1]);
+        return true;
+    case 0x160:
+        s[0] = call(l[0], 0, f->sp);
+        break;
+    case 0x161: case 0x162: case 0x163:  /* callfi, callfii, callfiii */
+        for (n = 1; n < nl; ++n) f->sp[nl - 1 - n] = l[n];
+        s[0] = call(l[0], nl - 1, f->sp + nl - 1);
+        break;
+
+    case 0x40: case 0x41: case 0x42: s[0] = l[0]; break;
+    case 0x44: s[0] = (int16_t)l[0]; break;
+    case 0x45: s[0] = (int8_t)l[0]; break;
+
+    case 0x48: s[0] = get_long(l[0] + 4*l[1]); break;
+    case 0x49: s[0] = get_shrt(l[0] + 2*l[1]); break;
+    case 0x4a: s[0] = get_byte(l[0] + l[1]); break;
+    case 0x4c: set_long(l[0] + 4*l[1], l[2]); break;
+    case 0x4d: set_shrt(l[0] + 2*l[1], l[2]); break;
+    case 0x4e: set_byte(l[0] + l[1], l[2]); break;
+    case 0x4b:
+    case 0x4f:
+        {
+            uint32_t b = l[1]&7, a = l[0] + ((int32_t)(l[1] - b))/8;
+            if (opcode == 0x4b)
+                s[0] = (get_byte(a) >> b) & 1;
+            else
+                set_byte(a, (get_byte(a) & ~(1 << b)) | ((l[2] != 0) << b));
+        } break;
+
+    case 0x50: s[0] = f->sp - f->bp; break;
+    case 0x51: s[0] = *(f->sp - l[0] - 1); break;
+    case 0x52:
+        {
+            uint32_t tmp = f->sp[-1];
+            f->sp[-1] = f->sp[-2];
+            f->sp[-2] = tmp;
+        } break;
+    case 0x53: native_stkroll(l[0], l[1], f->sp); break;
+    case 0x54:
+        for (n = 0; n < l[0]; ++n) f->sp[n] = f->sp[(int)(n - l[0])];
+        f->sp += l[0];
+        break;
+
+    case 0x70: native_streamchar(l[0], f->sp); break;
+    case 0x71: native_streamnum(l[0], f->sp); break;
+    case 0x72: native_streamstr(l[0], f->sp); break;
+    case 0x73: native_streamunichar(l[0], f->sp); break;
+
+    case 0x100: s[0] = native_gestalt(l[0], l[1]); break;
+    case 0x101: native_debugtrap(l[0]); break;
+    case 0x102: s[0] = native_getmemsize(); break;
+    case 0x103: s[0] = native_setmemsize(l[0]); break;
+    case 0x110: s[0] = native_random(l[0]); break;
+    case 0x111: native_setrandom(l[0]); break;
+    case 0x120: native_quit(); break;
+    case 0x121: s[0] = native_verify(); break;
+    case 0x122: native_restart(); break;
+    case 0x123:
+        {
+            struct Context ctx;
+            s[0] = (int32_t)context_save(&ctx);
+            if (s[0] == 0) s[0] = native_save(l[0], f->sp, &ctx);
+            store(f, smode[0], saddr[0], s[0], 4);
+        }
+        return false;  /* stored here, since the context returns twice */
+    case 0x124: s[0] = native_restore(l[0]); break;
+    case 0x125:
+        {
+            struct Context ctx;
+            s[0] = (int32_t)context_save(&ctx);
+            if (s[0] == 0) s[0] = native_saveundo(f->sp, &ctx);
+            store(f, smode[0], saddr[0], s[0], 4);
+        }
+        return false;  /* stored here, since the context returns twice */
+    case 0x126: s[0] = native_restoreundo(); break;
+    case 0x127: native_protect(l[0], l[1]); break;
+    case 0x130: s[0] = native_glk(l[0], l[1], &f->sp); break;
+    case 0x140: s[0] = native_getstringtbl(); break;
+    case 0x141: native_setstringtbl(l[0]); break;
+    case 0x148: native_getiosys(&s[0], &s[1]); break;
+    case 0x149: native_setiosys(l[0], l[1]); break;
+    case 0x150:
+        s[0] = native_linearsearch(l[0], l[1], l[2], l[3], l[4], l[5], l[6]);
+        break;
+    case 0x151:
+        s[0] = native_binarysearch(l[0], l[1], l[2], l[3], l[4], l[5], l[6]);
+        break;
+    case 0x152:
+        s[0] = native_linkedsearch(l[0], l[1], l[2], l[3], l[4], l[5]);
+        break;
+    case 0x170: memset(&mem[l[1]], 0, l[0]); break;
+    case 0x171: memmove(&mem[l[2]], &mem[l[1]], l[0]); break;
+    case 0x178: s[0] = native_malloc(l[0]); break;
+    case 0x179: native_mfree(l[0]); break;
+    case 0x180: native_accelfunc(l[0], l[1]); break;
+    case 0x181: native_accelparam(l[0], l[1]); break;
+
+    case 0x190: s[0] = float_to_long((float)(int32_t)l[0]); break;
+    case 0x191: s[0] = native_ftonumz(F(0)); break;
+    case 0x192: s[0] = native_ftonumn(F(0)); break;
+    case 0x198: s[0] = float_to_long(ceilf(F(0))); break;
+    case 0x199: s[0] = float_to_long(floorf(F(0))); break;
+    case 0x1a0: s[0] = float_to_long(F(0) + F(1)); break;
+    case 0x1a1: s[0] = float_to_long(F(0) - F(1)); break;
+    case 0x1a2: s[0] = float_to_long(F(0) * F(1)); break;
+    case 0x1a3: s[0] = float_to_long(F(0) / F(1)); break;
+    case 0x1a4:
+        {
+            float r = fmodf(F(0), F(1)), q = truncf(F(0)/F(1));
+            if (r != r) r = F(0)*NAN, q *= NAN;
+            s[0] = float_to_long(r);
+            s[1] = float_to_long(q);
+        } break;
+    case 0x1a8: s[0] = float_to_long(sqrtf(F(0))); break;
+    case 0x1a9: s[0] = float_to_long(expf(F(0))); break;
+    case 0x1aa: s[0] = float_to_long(logf(F(0))); break;
+    case 0x1ab: s[0] = float_to_long(powf(F(0), F(1))); break;
+    case 0x1b0: s[0] = float_to_long(sinf(F(0))); break;
+    case 0x1b1: s[0] = float_to_long(cosf(F(0))); break;
+    case 0x1b2: s[0] = float_to_long(tanf(F(0))); break;
+    case 0x1b3: s[0] = float_to_long(asinf(F(0))); break;
+    case 0x1b4: s[0] = float_to_long(acosf(F(0))); break;
+    case 0x1b5: s[0] = float_to_long(atanf(F(0))); break;
+    case 0x1b6: s[0] = float_to_long(atan2f(F(0), F(1))); break;
+    case 0x1c0: BRANCH(  fabsf(F(0) - F(1)) <= fabsf(F(2)) );
+    case 0x1c1: BRANCH(!(fabsf(F(0) - F(1)) <= fabsf(F(2))));
+    case 0x1c2: BRANCH(F(0) <  F(1));
+    case 0x1c3: BRANCH(F(0) <= F(1));
+    case 0x1c4: BRANCH(F(0) >  F(1));
+    case 0x1c5: BRANCH(F(0) >= F(1));
+    case 0x1c8: BRANCH(F(0) != F(0));
+    case 0x1c9: BRANCH(F(0) == F(0) && F(0) - F(0) != F(0) - F(0));
+
+    default:
+        fatal("unimplemented opcode 0x%x at offset 0x%08x", opcode, pc);
+    }
+
+#undef F
+#undef BRANCH
+
+    /* Store results: */
+    for (n = 0; n < ns; ++n)
+    {
+        store(f, smode[n], saddr[n], s[n], size);
+    }
+    return false;
+
+do_branch:
+    if (branch == 0 || branch == 1)
+    {
+        *result = branch;
+        return true;
+    }
+    f->pc += branch - 2;
+    return false;
+}
+
+/* Executes the function in frame `f' and returns its return value. Contexts
+   for catch are saved here rather than in step(), so that few variables are
+   live across context_save(). */
+static uint32_t execute(struct Frame *f)
+{
+    uint32_t result;
+    struct CatchStub *thrown;
+
+    f->catch = NULL;
+    while (!step(f, &result))
+    {
+        if (f->catch == NULL) continue;
+        thrown = context_save(&f->catch->ctx);
+        f->catch = NULL;
+        if (thrown != NULL)
+        {
+            /* Resumed by throw: pop the stub, and store the thrown value where
+               the catch instruction stored its token. */
+            uint32_t opcode, modes[MAX_OPERANDS], args[MAX_OPERANDS];
+
+            f->sp = (uint32_t*)thrown;
+            f->pc = decode(thrown->pc, &opcode, modes, args);
+            store(f, modes[0], args[0], thrown->value, 4);
+        }
+    }
+    native_catch_release(&f->bp);
+    globals_reload();
+    return result;
+}
+
+uint32_t native_interp_call(uint32_t addr, uint32_t *sp)
+{
+    struct Frame f;
+    uint32_t size;
+
+    if (addr >= native_getmemsize() ||
+        (get_byte(addr) != 0xc0 && get_byte(addr) != 0xc1))
+    {
+        fatal("call to non-function at offset 0x%08x", addr);
+        return 0;
+    }
+    size = locals_size(addr, &f.pc);
+    f.addr   = addr;
+    f.locals = alloca(size);
+    memset(f.locals, 0, size);
+    if (get_byte(addr) == 0xc0)
+    {
+        f.bp = sp - *sp;
+        f.sp = sp + 1;
+    }
+    else
+    {
+        set_args(addr, f.locals, sp, *sp);
+        f.bp = f.sp = sp - *sp;
+    }
+    return execute(&f);
+}
+
+uint32_t native_interp_resume(uint32_t addr, uint32_t pc,
+                              const uint32_t *locals, uint32_t nlocal,
+                              uint32_t *bp, uint32_t *sp)
+{
+    struct Frame f;
+    uint32_t size, code;
+
+    size = locals_size(addr, &code);
+    if (4*nlocal > size)
+        fatal("invalid locals for function at offset 0x%08x", addr);
+    f.addr   = addr;
+    f.pc     = pc;
+    f.bp     = bp;
+    f.sp     = sp;
+    f.locals = alloca(size);
+    memset(f.locals, 0, size);
+    memcpy(f.locals, locals, 4*nlocal);
+    return execute(&f);
+}
+
+uint32_t native_interp_branch(uint32_t addr, uint32_t next_pc, uint32_t offset,
+                              const uint32_t *locals, uint32_t nlocal,
+                              uint32_t *bp, uint32_t *sp)
+{
+    if (offset == 0 || offset == 1) return offset;
+    return native_interp_resume( addr, next_pc + offset - 2,
+                                 locals, nlocal, bp, sp );
+}
+
+/* Entry point for tail calls to functions that haven't been translated.  The
+   address of the function is passed in sp[1], just above the argument count,
+   so that nested calls through this entry point don't interfere: */
+uint32_t native_interp_tail_entry(uint32_t *sp)
+{
+    return native_interp_call(sp[1], sp);
+}
@@ -38,6 +38,39 @@ static struct StringTableEntry
 /* Temporarily exported stack pointer (for use by GLK dispatch layer): */
 uint32_t **glk_stack_ptr = NULL;
 
+/* IDs of the byte memory streams that the story has opened, which Glk writes
+   to memory directly as text is printed.  Translated code checks that
+   memory_streams is nonzero before reloading promoted global variables after
+   printing (see glulx-to-c.py): */
+static uint32_t *memory_stream_ids = NULL;
+uint32_t memory_streams = 0;
+
+static void track_memory_streams(uint32_t selector, const uint32_t *args,
+                                 uint32_t res)
+{
+    uint32_t n;
+
+    if (selector == 0x0043 && res != 0)  /* stream_open_memory */
+    {
+        memory_stream_ids = realloc( memory_stream_ids,
+            (memory_streams + 1)*sizeof(*memory_stream_ids) );
+        if (memory_stream_ids == NULL)
+            fatal("out of memory");
+        memory_stream_ids[memory_streams++] = res;
+    }
+    else if (selector == 0x0044)  /* stream_close */
+    {
+        for (n = 0; n < memory_streams; ++n)
+        {
+            if (memory_stream_ids[n] == args[0])
+            {
+                memory_stream_ids[n] = memory_stream_ids[--memory_streams];
+                break;
+            }
+        }
+    }
+}
+
 
 void native_getiosys(uint32_t *mode, uint32_t *rock)
 {
@@ -75,6 +108,7 @@ uint32_t native_glk(uint32_t selector, uint32_t narg, uint32_t **sp)
     glk_stack_ptr = sp;
     res = perform_glk(selector, narg, args);
     glk_stack_ptr = NULL;
+    if (narg > 0) track_memory_streams(selector, args, res);
 
 #ifdef NATIVE_DEBUG_GLK
     printf(" => %d\n", res);
@@ -95,8 +129,20 @@ void native_setiosys(uint32_t mode, uint32_t rock)
         cur_iosys_mode = 0;
         break;
 
-    case IOSYS_NULL:
     case IOSYS_FILTER:
+        if (!init_filter_iosys)
+        {
+            /* The story code doesn't select the filter I/O system, so the
+               translated code may print without a data stack pointer to call
+               the filter function with (see glulx-to-c.py): */
+            error("filter I/O mode not supported by story code");
+            cur_iosys_mode = 0;
+            break;
+        }
+        cur_iosys_mode = mode;
+        break;
+
+    case IOSYS_NULL:
     case IOSYS_GLK:
         cur_iosys_mode = mode;
         break;
@@ -173,7 +219,7 @@ static void filter_char_uni(uint32_t ch, uint32_t *sp)
 {
     sp[0] = ch;
     sp[1] = 1;
-    func(cur_iosys_rock)(sp + 1);
+    call_func(cur_iosys_rock, sp + 1);
 }
 
 static void put_string(char *s, uint32_t *sp)
@@ -350,7 +396,7 @@ static void stream_compressed_string(uint32_t string_offset, uint32_t *sp)
                         sp[narg] = narg;
 
                         /* Call function */
-                        func(obj_offset)(sp + narg);
+                        call_func(obj_offset, sp + narg);
                     }
                     break;
 
@@ -395,6 +441,35 @@ void native_streamstr(uint32_t offset, uint32_t *sp)
     }
 }
 
+/* Prints the string object at `offset' that was decoded by the translator
+   into `len' Latin-1 characters.  Compressed strings were decoded with the
+   initial decoding table, so if another table is active (or output doesn't
+   go to Glk), the string is printed as usual: */
+void native_streamstr_latin1(uint32_t offset, const char *s, uint32_t len,
+                             uint32_t *sp)
+{
+    if (cur_iosys_mode != IOSYS_GLK ||
+        (cur_decoding_tbl != init_decoding_tbl && mem[offset] == 0xe1))
+    {
+        native_streamstr(offset, sp);
+        return;
+    }
+    glk_put_buffer((char*)s, len);
+}
+
+/* Like native_streamstr_latin1(), for strings with Unicode characters: */
+void native_streamstr_uni(uint32_t offset, const uint32_t *s, uint32_t len,
+                          uint32_t *sp)
+{
+    if (cur_iosys_mode != IOSYS_GLK ||
+        (cur_decoding_tbl != init_decoding_tbl && mem[offset] == 0xe1))
+    {
+        native_streamstr(offset, sp);
+        return;
+    }
+    glk_put_buffer_uni((glui32*)s, len);
+}
+
 uint32_t *native_ustring_dup(uint32_t offset)
 {
     uint32_t *res;
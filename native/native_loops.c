@@ -0,0 +1,97 @@
+#include "native.h"
+#include <assert.h>
+
+/* Kernels for loop idioms.  The translator replaces counted loops that copy,
+   fill, search or compare arrays one element at a time (see
+   find_loop_idioms() in analyze.py) with a call to one of these functions.
+
+   Arrays consist of `count' elements of `size' bytes (1, 2 or 4), stored in
+   big-endian order.  Each function has the same effect as the loop it
+   replaces, including when arrays overlap, but processes whole blocks of
+   memory where possible instead of one byte-swapped element at a time. */
+
+/* Copies elements one by one, from first to last. */
+void native_loop_copy(uint32_t dst, uint32_t src, uint32_t count,
+                      uint32_t size)
+{
+    uint32_t i;
+
+    if (dst <= src || dst - src >= count*size)
+    {
+        /* Elements are never read after they are overwritten: */
+        memmove(mem + dst, mem + src, count*size);
+    }
+    else
+    {
+        /* Earlier elements are copied into later ones: */
+        for (i = 0; i < count; ++i)
+            memmove(mem + dst + i*size, mem + src + i*size, size);
+    }
+}
+
+/* Stores `value', truncated to the element size, in each element. */
+void native_loop_fill(uint32_t dst, uint32_t value, uint32_t count,
+                      uint32_t size)
+{
+    uint32_t i;
+
+    switch (size)
+    {
+    case 1:
+        memset(mem + dst, (uint8_t)value, count);
+        break;
+    case 2:
+        for (i = 0; i < count; ++i) set_shrt(dst + 2*i, value);
+        break;
+    case 4:
+        for (i = 0; i < count; ++i) set_long(dst + 4*i, value);
+        break;
+    default:
+        assert(0);
+    }
+}
+
+/* Returns the index of the first element that is equal to `value' (or
+   unequal, if `equal' is zero), or `count' if there is none. */
+uint32_t native_loop_find(uint32_t base, uint32_t value, uint32_t count,
+                          uint32_t size, uint32_t equal)
+{
+    const uint8_t *p;
+    uint32_t i;
+
+    switch (size)
+    {
+    case 1:
+        if (equal)
+        {
+            if (value > 0xff) return count;
+            p = memchr(mem + base, value, count);
+            return p != NULL ? (uint32_t)(p - (mem + base)) : count;
+        }
+        for (i = 0; i < count; ++i)
+            if (get_byte(base + i) != value) break;
+        return i;
+    case 2:
+        for (i = 0; i < count; ++i)
+            if ((get_shrt(base + 2*i) == value) == (equal != 0)) break;
+        return i;
+    case 4:
+        for (i = 0; i < count; ++i)
+            if ((get_long(base + 4*i) == value) == (equal != 0)) break;
+        return i;
+    }
+    assert(0);
+    return count;
+}
+
+/* Returns the index of the first element that differs between the arrays,
+   or `count' if they are equal. */
+uint32_t native_loop_compare(uint32_t a, uint32_t b, uint32_t count,
+                             uint32_t size)
+{
+    uint32_t i;
+
+    if (memcmp(mem + a, mem + b, count*size) == 0) return count;
+    for (i = 0; mem[a + i] == mem[b + i]; ++i) { }
+    return i/size;
+}
@@ -0,0 +1,94 @@
+#include "native.h"
+#include "storycode.h"
+#include "messages.h"
+#include <stdio.h>
+
+/* Execution profile of translated code.
+
+   With --profile-instrument, translated code counts in profile_counts[] how
+   often each function is entered and how often each conditional branch is
+   executed and taken, as listed in profile_sites[].  Calls to computed
+   addresses are counted here, by call site and target.  On quit, the counts
+   are saved to PROFILE_FILE, for use with --profile.
+
+   Sites are identified by the offsets of the instructions in the story file
+   (instructions of inlined functions count for the original instruction),
+   and the profile starts with the story's checksum, so that it can be
+   reused for any translation of the same story, but not for another one.
+   Each line of the file holds a kind of count, an offset and the count:
+
+       checksum <checksum>
+       f <function> <entries>
+       b <branch> <executions>
+       t <branch> <times taken>
+       c <call site> <target> <calls>
+
+   Lines may occur more than once for the same site, in which case their
+   counts add up. */
+
+#define PROFILE_FILE "native-profile.txt"
+
+/* Open hash table of (call site, target) pairs: */
+#define CALL_BITS 14
+
+static struct ProfileCall
+{
+    uint32_t site, addr, count;
+} calls[1 << CALL_BITS];
+static uint32_t calls_dropped = 0;
+
+void native_profile_call(uint32_t site, uint32_t addr)
+{
+    uint32_t i = ((site*31 + addr)*0x9e3779b1u) >> (32 - CALL_BITS), n;
+
+    for (n = 0; n < (1u << CALL_BITS); ++n)
+    {
+        struct ProfileCall *call = &calls[(i + n) & ((1 << CALL_BITS) - 1)];
+        if (call->count == 0)
+        {
+            call->site = site;
+            call->addr = addr;
+        }
+        if (call->site == site && call->addr == addr)
+        {
+            ++call->count;
+            return;
+        }
+    }
+    ++calls_dropped;
+}
+
+void native_profile_report(void)
+{
+    FILE *fp;
+    uint32_t n;
+
+    if (profile_sites[0].kind == 0) return;  /* not instrumented */
+    fp = fopen(PROFILE_FILE, "wt");
+    if (fp == NULL)
+    {
+        error("could not write " PROFILE_FILE);
+        return;
+    }
+    fprintf(fp, "checksum %08x\n", init_checksum);
+    for (n = 0; profile_sites[n].kind != 0; ++n)
+    {
+        if (profile_counts[n] > 0)
+        {
+            fprintf(fp, "%c %08x %u\n", profile_sites[n].kind,
+                    profile_sites[n].offset, profile_counts[n]);
+        }
+    }
+    for (n = 0; n < (1u << CALL_BITS); ++n)
+    {
+        if (calls[n].count > 0)
+        {
+            fprintf(fp, "c %08x %08x %u\n", calls[n].site, calls[n].addr,
+                    calls[n].count);
+        }
+    }
+    fclose(fp);
+    if (calls_dropped > 0)
+        info("%u calls not profiled (too many call targets)", calls_dropped);
+    info("profile saved to " PROFILE_FILE);
+}
@@ -17,13 +17,13 @@ static size_t offset, size;
 void push_protected()
 {
     assert(data == NULL);
-    if (cur_protect_offset < init_endmem && cur_protect_size > 0)
+    if (cur_protect_offset < native_getmemsize() && cur_protect_size > 0)
     {
         offset = cur_protect_offset;
         size   = cur_protect_size;
-        if (init_endmem - cur_protect_offset < size)
+        if (native_getmemsize() - cur_protect_offset < size)
         {
-            size = init_endmem - cur_protect_offset;
+            size = native_getmemsize() - cur_protect_offset;
         }
         data = malloc(size);
         assert(data != NULL);
@@ -7,9 +7,13 @@
 
 /* Serialized state consists of:
 
-    (init_endmem - init_ramstart) bytes: mem[init_ramstart:init_endmem)
+    4 bytes: memory size, M
+    (M - init_ramstart) bytes: mem[init_ramstart:M)
+    4 bytes: heap state size, H
+    H bytes: heap state (see native_heap.c)
     4 bytes: data stack size, D
     D bytes: data_stack[0:D)
+    4 bytes: innermost catch stub that can be thrown to (see native_catch())
     4 bytes: call stack size, C
     C bytes: call_stack[CALL_STACK_SIZE - C, CALL_STACK_SIZE)
     4 bytes: pointer to execution context
@@ -17,10 +21,17 @@
   All values are stored in native byte-order.
 */
 
-static uint32_t fnv1_32(const void *data, size_t size)
+#define FNV1_32_INIT 2166136261u
+
+size_t native_heap_serialize(char *data);
+void native_heap_deserialize(const char *data, size_t size);
+
+/* Defined in native.c */
+extern struct CatchStub *catch_top;
+
+static uint32_t fnv1_32(uint32_t hash, const void *data, size_t size)
 {
     const unsigned char *p = data;
-    uint32_t hash = 2166136261u;
     while (size-- > 0)
     {
         hash *= 16777619;
@@ -29,11 +40,26 @@ static uint32_t fnv1_32(const void *data, size_t size)
     return hash;
 }
 
+/* Hashes the func_table[] array as generated, ignoring any entries that have
+   been replaced by accelerated functions. */
+static uint32_t func_table_hash(void)
+{
+    uint32_t hash = FNV1_32_INIT, n;
+    for (n = 0; n < func_count; ++n)
+    {
+        uint32_t addr = func_table[n].addr;
+        uint32_t (*f)(uint32_t*) = native_accel_original(addr);
+        hash = fnv1_32(hash, &addr, sizeof(addr));
+        hash = fnv1_32(hash, &f, sizeof(f));
+    }
+    return hash;
+}
+
 /* Calculates a 16-byte identifier for the storycode, which is used to detect
    (in)compatible saved states.
 
    For now, I just record the call stack location and a checksum of the
-   func_map[] array, which is a reasonable approximation of the generated code
+   func_table[] array, which is a reasonable approximation of the generated code
    (in that it cover function addresses and sizes).
 
    Note: this function is not re-entrant until after it has been called once!
@@ -44,7 +70,7 @@ static const char *get_binary_id(void)
     extern struct Context *start_ctx;
     if (bin_id[0] == 0)
     {
-        bin_id[0] = fnv1_32(func_map, init_ramstart);
+        bin_id[0] = func_table_hash();
         bin_id[1] = (uint32_t)call_stack;
         bin_id[2] = (uint32_t)start_ctx;
         bin_id[3] = 0;  /* unused for now */
@@ -56,11 +82,13 @@ static const char *get_binary_id(void)
 static void print_checksum(const uint32_t *data_sp, const char *call_sp)
 {
     info("memory checksum     %08x",
-         fnv1_32(mem, init_endmem));
+         fnv1_32(FNV1_32_INIT, mem, init_endmem));
     info("data stack checksum %08x",
-         fnv1_32(data_stack, sizeof(*data_sp)*(data_sp - data_stack)));
+         fnv1_32(FNV1_32_INIT, data_stack,
+                 sizeof(*data_sp)*(data_sp - data_stack)));
     info("call stack checksum %08x",
-         fnv1_32(call_sp, call_stack + CALL_STACK_SIZE - call_sp));
+         fnv1_32(FNV1_32_INIT, call_sp,
+                 call_stack + CALL_STACK_SIZE - call_sp));
 }
 */
 
@@ -69,6 +97,7 @@ char *native_serialize(uint32_t *data_sp, struct Context *ctx, size_t *size)
 {
     const char *call_sp  = (char*)ctx->esp,
                *stack_end = call_stack + CALL_STACK_SIZE;
+    uint32_t memory_size = mem_size, heap_size;
     uint32_t data_stack_size, call_stack_size;
     size_t data_size;
     char *data, *pos;
@@ -79,12 +108,17 @@ char *native_serialize(uint32_t *data_sp, struct Context *ctx, size_t *size)
     /* Verify context structure is on the stack: */
     assert((char*)ctx >= call_sp && (char*)(ctx + 1) <= stack_end);
 
+    heap_size       = native_heap_serialize(NULL);
     data_stack_size = sizeof(*data_sp)*(data_sp - data_stack);
     call_stack_size = stack_end - call_sp;
 
-    data_size = init_endmem - init_ramstart;    /* interpreter memory */
+    data_size = sizeof(memory_size);            /* memory size */
+    data_size += memory_size - init_ramstart;   /* interpreter memory */
+    data_size += sizeof(heap_size);             /* heap state size */
+    data_size += heap_size;                     /* heap state */
     data_size += sizeof(size_t);                /* data stack size */
     data_size += data_stack_size;               /* data stack */
+    data_size += sizeof(catch_top);             /* catch stub chain */
     data_size += sizeof(size_t);                /* call stack size */
     data_size += call_stack_size;               /* call stack */
     data_size += sizeof(ctx);                   /* execution context */
@@ -93,8 +127,16 @@ char *native_serialize(uint32_t *data_sp, struct Context *ctx, size_t *size)
     if (pos == NULL) return NULL;
 
     /* interpreter memory */
-    memcpy(pos, mem + init_ramstart, init_endmem - init_ramstart);
-    pos += init_endmem - init_ramstart;
+    memcpy(pos, &memory_size, sizeof(memory_size));
+    pos += sizeof(memory_size);
+    memcpy(pos, mem + init_ramstart, memory_size - init_ramstart);
+    pos += memory_size - init_ramstart;
+
+    /* heap state */
+    memcpy(pos, &heap_size, sizeof(heap_size));
+    pos += sizeof(heap_size);
+    native_heap_serialize(pos);
+    pos += heap_size;
 
     /* data stack */
     memcpy(pos, &data_stack_size, sizeof(data_stack_size));
@@ -102,6 +144,10 @@ char *native_serialize(uint32_t *data_sp, struct Context *ctx, size_t *size)
     memcpy(pos, data_stack, data_stack_size);
     pos += data_stack_size;
 
+    /* catch stub chain (on the data stack) */
+    memcpy(pos, &catch_top, sizeof(catch_top));
+    pos += sizeof(catch_top);
+
     /* call stack */
     memcpy(pos, &call_stack_size, sizeof(call_stack_size));
     pos += sizeof(call_stack_size);
@@ -126,13 +172,25 @@ char *native_serialize(uint32_t *data_sp, struct Context *ctx, size_t *size)
 struct Context *native_deserialize(char *data, size_t size)
 {
     struct Context *ctx;
+    uint32_t memory_size;
+    uint32_t heap_size;
     uint32_t data_stack_size;
     uint32_t call_stack_size;
     char *pos = data;
 
     /* interpreter memory */
-    memcpy(mem + init_ramstart, pos, init_endmem - init_ramstart);
-    pos += init_endmem - init_ramstart;
+    memcpy(&memory_size, pos, sizeof memory_size);
+    pos += sizeof memory_size;
+    assert(memory_size >= init_endmem && memory_size <= MAX_MEM_SIZE);
+    mem_size = memory_size;
+    memcpy(mem + init_ramstart, pos, memory_size - init_ramstart);
+    pos += memory_size - init_ramstart;
+
+    /* heap state */
+    memcpy(&heap_size, pos, sizeof heap_size);
+    pos += sizeof heap_size;
+    native_heap_deserialize(pos, heap_size);
+    pos += heap_size;
 
     /* data stack */
     memcpy(&data_stack_size, pos, sizeof data_stack_size);
@@ -140,6 +198,10 @@ struct Context *native_deserialize(char *data, size_t size)
     memcpy(data_stack, pos, data_stack_size);
     pos += data_stack_size;
 
+    /* catch stub chain (on the data stack) */
+    memcpy(&catch_top, pos, sizeof catch_top);
+    pos += sizeof catch_top;
+
     /* call stack */
     memcpy(&call_stack_size, pos, sizeof call_stack_size);
     pos += sizeof call_stack_size;
@@ -395,8 +457,15 @@ static const size_t IFZS_form_overhead =
 void native_save_serialized(const char *data, size_t size, strid_t stream)
 {
     const bool compress_memory = true;  /* CMem or UMem chunks? */
-    const size_t ram_size = init_endmem - init_ramstart;
-    size_t form_size = size, cmem_size = 0;
+    uint32_t memory_size;
+    size_t ram_size, form_size, cmem_size = 0;
+
+    /* The memory size is stored in the memory chunk header: */
+    memcpy(&memory_size, data, sizeof(memory_size));
+    data += sizeof(memory_size);
+    size -= sizeof(memory_size);
+    ram_size  = memory_size - init_ramstart;
+    form_size = size;
 
     if (compress_memory)
     {
@@ -420,7 +489,7 @@ void native_save_serialized(const char *data, size_t size, strid_t stream)
     {
         write_fourcc(stream, "UMem");
         write_uint32(stream, 4 + ram_size);
-        write_uint32(stream, ram_size);
+        write_uint32(stream, memory_size);
         glk_put_buffer_stream(stream, (char*)data, ram_size);
         assert((ram_size&1) == 0);
     }
@@ -428,7 +497,7 @@ void native_save_serialized(const char *data, size_t size, strid_t stream)
     {
         write_fourcc(stream, "CMem");
         write_uint32(stream, 4 + cmem_size);
-        write_uint32(stream, ram_size);
+        write_uint32(stream, memory_size);
         write_cmem(stream, (const uint8_t*)data, ram_size);
         if (cmem_size&1) glk_put_char_stream(stream, 0);  /* 16-bit alignment */
     }
@@ -449,9 +518,9 @@ static uint32_t get_uint32(char buf[4])
 
 char *native_restore_serialized(strid_t stream, size_t *size_out)
 {
-    const size_t ram_size = init_endmem - init_ramstart;
-    char buf[128], *data = NULL;
-    size_t size = 0, form_size, cmem_size;
+    uint32_t memory_size;
+    char buf[128], *state = NULL, *data;
+    size_t size = 0, ram_size, form_size, cmem_size;
 
     /* Verify file header: */
     if (glk_get_buffer_stream(stream, buf, 12) != 12 ||
@@ -481,21 +550,31 @@ char *native_restore_serialized(strid_t stream, size_t *size_out)
     /* Read memory chunk */
     if (glk_get_buffer_stream(stream, buf, 12) != 12 ||
         (memcmp(buf, "UMem", 4) != 0 && memcmp(buf, "CMem", 4) != 0) ||
-        get_uint32(buf + 4) <= 4 || get_uint32(buf + 8) != ram_size)
+        get_uint32(buf + 4) <= 4)
     {
         error("invalid/missing UMem/CMem chunk");
         goto failed;
     }
+    memory_size = get_uint32(buf + 8);
+    if (memory_size < init_endmem || memory_size > MAX_MEM_SIZE ||
+        memory_size%256 != 0)
+    {
+        error("invalid memory size (%u) in UMem/CMem chunk", memory_size);
+        goto failed;
+    }
+    ram_size = memory_size - init_ramstart;
 
-    /* Allocate memory: */
+    /* Allocate memory (for the memory size followed by the chunk data): */
     cmem_size = get_uint32(buf + 4) - 4;
     size = form_size - IFZS_form_overhead - ((cmem_size + 1) & ~1) + ram_size;
-    data = malloc(size);
-    if (data == NULL)
+    state = malloc(sizeof(memory_size) + size);
+    if (state == NULL)
     {
         error("out of memory");
         goto failed;
     }
+    memcpy(state, &memory_size, sizeof(memory_size));
+    data = state + sizeof(memory_size);
 
     if (memcmp(buf, "UMem", 4) == 0)
     {
@@ -558,10 +637,10 @@ char *native_restore_serialized(strid_t stream, size_t *size_out)
         error("incompatible binary version");
         goto failed;
     }
-    *size_out = size;
-    return data;
+    *size_out = sizeof(memory_size) + size;
+    return state;
 
 failed:
-    if (data != NULL) free(data);
+    if (state != NULL) free(state);
     return NULL;
 }
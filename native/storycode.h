@@ -13,10 +13,104 @@ extern const uint32_t init_start_func;
 extern const uint32_t init_decoding_tbl;
 extern const uint32_t init_checksum;
 
-/* Function map covering addresses from 0 to init_ramstart: */
-extern uint32_t (* const func_map[])(uint32_t*);
-#define func(addr) func_map[addr/4]
+/* Whether the story may select the filter I/O system: */
+extern const uint32_t init_filter_iosys;
+
+/* Ranges [start, end) of RAM from which translated code has folded loads
+   (with --frozen-ram), terminated by an empty range.  Their pages are kept
+   read-only (see native_frozen.c): */
+extern const struct FrozenRange
+{
+    uint32_t start, end;
+} frozen_ram[];
+
+/* Counters of translated code (with --profile-instrument), and the kind and
+   story file offset of each: 'f' for entries into the function at that
+   offset, 'b' for executions of the conditional branch there and 't' for
+   times it was taken.  Terminated by kind 0 (see native_profile.c): */
+extern uint32_t profile_counts[];
+extern const struct ProfileSite
+{
+    char kind;
+    uint32_t offset;
+} profile_sites[];
+
+/* Counts a call to `addr' from the call site at offset `site': */
+void native_profile_call(uint32_t site, uint32_t addr);
+
+/* Translated functions, in order of address (entries may be replaced at
+   runtime by accelerated functions): */
+struct FuncEntry
+{
+    uint32_t addr;
+    uint32_t (*ptr)(uint32_t*);
+};
+extern struct FuncEntry func_table[];
+extern const uint32_t func_count;
+
+/* Index into func_table[] with one block for every 128 bytes below
+   init_ramstart: bit n of `bits' is set if a function starts at one of the
+   addresses 4*n to 4*n + 3 of the block, and `first' is the index of the
+   first function in the block.  Finding a function takes two loads, while
+   the index is 16 times smaller than a pointer for every 4 bytes of ROM. */
+extern const struct FuncBlock
+{
+    uint32_t first;
+    uint32_t bits;
+} func_index[];
+
+static inline uint32_t bit_count(uint32_t x)
+{
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f;
+    return (x*0x01010101) >> 24;
+}
+
+/* Returns the func_table[] entry for the function at `addr', or NULL if
+   there is no translated function at that address: */
+static inline struct FuncEntry *func_entry(uint32_t addr)
+{
+    const struct FuncBlock *block;
+    struct FuncEntry *entry;
+    uint32_t bit;
+
+    if (addr >= init_ramstart) return NULL;
+    block = &func_index[addr/128];
+    bit = 1u << (addr/4%32);
+    if (!(block->bits & bit)) return NULL;
+    entry = &func_table[block->first + bit_count(block->bits & (bit - 1))];
+    return entry->addr == addr ? entry : NULL;
+}
+
+/* Returns the translated function at `addr', or NULL: */
+static inline uint32_t (*func(uint32_t addr))(uint32_t*)
+{
+    struct FuncEntry *entry = func_entry(addr);
+    return entry != NULL ? entry->ptr : NULL;
+}
+
+/* Calls the function at `addr' with `*sp' arguments on the data stack below
+   `sp', using the interpreter for functions that have not been translated: */
+#define call_func(addr, sp) ({ uint32_t call_addr = (addr);                 \
+        uint32_t (*call_ptr)(uint32_t*) = func(call_addr);                  \
+        call_ptr != NULL ? call_ptr(sp) : native_interp_call(call_addr, (sp)); })
 
 void *init_start_thunk(void *ctx_out);
 
+/* Clears the caches of translated call sites that call computed addresses,
+   which hold the functions they called last.  Must be called whenever an
+   entry of func_table[] changes: */
+void call_caches_reset(void);
+
+/* Reloads the global variables that translated code keeps in C variables
+   (with --promote-globals).  Translated code writes them through to memory,
+   but native code that changes memory behind its back, like the interpreter,
+   must call this before returning to translated code: */
+void globals_reload(void);
+
+/* Reports the hit rates of the result caches of memoized functions (with
+   --memoize) as informational messages: */
+void memo_report(void);
+
 #endif /* ndef STORYFILE_H_INCLUDED */